@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include "toychess.c"
+
+/*
+ * Search benchmark. Searches a set of positions to a fixed depth with 1, 2,
+ * 4... threads up to a maximum, reporting the time taken to reach the depth
+ * and nodes per second, to show how the Lazy SMP search scales. The
+ * selective search's prunings can each be switched off to measure what
+ * they save in nodes to depth, and mobility counted from legal moves.
+ * With -s it instead searches a suite of tactical positions and reports
+ * how many it finds the known best move for, to measure what the
+ * switches cost in play
+ */
+
+static const char *BENCH_POSITIONS[] = {
+    START_POS_FEN,
+    KIWIPETE_FEN,
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+};
+
+#define BENCH_POSITION_COUNT \
+    (int)(sizeof(BENCH_POSITIONS) / sizeof(BENCH_POSITIONS[0]))
+
+typedef struct {
+    const char *fen;
+    const char *best_move;  // from and to squares, e.g. g3g6
+} SuitePosition;
+
+// the first ten of Win At Chess
+static const SuitePosition SUITE_POSITIONS[] = {
+    {"2rr3k/pp3pp1/1nnqbN1p/3pN3/2pP4/2P3Q1/PPB4P/R4RK1 w - - 0 1", "g3g6"},
+    {"8/7p/5k2/5p2/p1p2P2/Pr1pPK2/1P1R3P/8 b - - 0 1", "b3b2"},
+    {"5rk1/1ppb3p/p1pb4/6q1/3P1p1r/2P1R2P/PP1BQ1P1/5RKN w - - 0 1", "e3g3"},
+    {"r1bq2rk/pp3pbp/2p1p1pQ/7P/3P4/2PB1N2/PP3PPR/2KR4 w - - 0 1", "h6h7"},
+    {"5k2/6pp/p1qN4/1p1p4/3P4/2PKP2Q/PP3r2/3R4 b - - 0 1", "c6c4"},
+    {"7k/p7/1R5K/6r1/6p1/6P1/8/8 w - - 0 1", "b6b7"},
+    {"rnbqkb1r/pppp1ppp/8/4P3/6n1/7P/PPPNPPP1/R1BQKBNR b KQkq - 0 1", "g4e3"},
+    {"r4q1k/p2bR1rp/2p2Q1N/5p2/5p2/2P5/PP3PPP/R5K1 w - - 0 1", "e7f7"},
+    {"3q1rk1/p4pp1/2pb3p/3p4/6Pr/1PNQ4/P1PB1PP1/4RRK1 b - - 0 1", "d6h2"},
+    {"2br2k1/2q3rn/p2NppQ1/2p1P3/Pp5R/4P3/1P3PPP/3R2K1 w - - 0 1", "h4h7"},
+};
+
+#define SUITE_POSITION_COUNT \
+    (int)(sizeof(SUITE_POSITIONS) / sizeof(SUITE_POSITIONS[0]))
+
+int run_suite(SearchLimits limits);
+void usage(const char *program);
+
+
+int run_suite(SearchLimits limits)
+{
+    // search each suite position, returning how many found the best move
+    SearchResult result;
+    struct timespec start;
+    char found[5];
+    uint64_t total_nodes = 0;
+    int solved = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < SUITE_POSITION_COUNT; i++) {
+        tt_clear();
+        result = search_iterative(fen_to_board(SUITE_POSITIONS[i].fen), limits);
+        total_nodes += search_stats.nodes;
+        strcpy(found, SQUARE_NAMES[bitscan(result.best_move.src)]);
+        strcat(found, SQUARE_NAMES[bitscan(result.best_move.dst)]);
+        if(strcmp(found, SUITE_POSITIONS[i].best_move) == 0)
+            solved++;
+        printf(
+            "position %2d depth %2d %12lu nodes  %s, best %s\n",
+            i + 1, result.depth, search_stats.nodes, found, SUITE_POSITIONS[i].best_move
+        );
+    }
+    printf(
+        "solved %d/%d to depth %d, %lu nodes in %ldms\n",
+        solved, SUITE_POSITION_COUNT, limits.max_depth, total_nodes, elapsed_ms(start)
+    );
+    return solved;
+}
+
+
+void usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [-nlfm] [-t max_threads] [-H hash_mb] [depth]\n", program);
+    fprintf(stderr, "       %s -s [-nlfm] [-t threads] [-H hash_mb] [depth]\n", program);
+    fprintf(stderr, "\n-n, -l and -f switch off null move pruning, late move reductions\n");
+    fprintf(stderr, "and futility pruning, -m counts mobility from legal moves\n");
+    fprintf(stderr, "-s reports how much of a best move suite is solved\n");
+    exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+    SearchLimits limits = {6, LONG_MAX, 0};
+    SearchResult result;
+    struct timespec start;
+    long taken;
+    long total_ms;
+    long single_thread_ms = 0;
+    uint64_t total_nodes;
+    size_t hash_mb = 64;
+    int max_threads = 1;
+    bool suite = false;
+    int threads;
+    int opt;
+    int i;
+
+    init_tables();
+    while((opt = getopt(argc, argv, "t:H:nlfms")) != -1) {
+        switch(opt) {
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            case 'H':
+                hash_mb = atoi(optarg);
+                break;
+            case 'n':
+                search_options.null_move = false;
+                break;
+            case 'l':
+                search_options.late_move_reductions = false;
+                break;
+            case 'f':
+                search_options.futility = false;
+                break;
+            case 'm':
+                eval_options.legal_mobility = true;
+                break;
+            case 's':
+                suite = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(max_threads < 1 || max_threads > MAX_SEARCH_THREADS)
+        usage(argv[0]);
+    if(optind < argc)
+        limits.max_depth = atoi(argv[optind]);
+    if(limits.max_depth < 1)
+        usage(argv[0]);
+    tt_init(hash_mb);
+    if(suite) {
+        search_threads = max_threads;
+        run_suite(limits);
+        return 0;
+    }
+
+    for(threads = 1; threads <= max_threads; threads *= 2) {
+        search_threads = threads;
+        total_ms = 0;
+        total_nodes = 0;
+        for(i = 0; i < BENCH_POSITION_COUNT; i++) {
+            // every run starts from an empty table, or later runs gain
+            tt_clear();
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            result = search_iterative(fen_to_board(BENCH_POSITIONS[i]), limits);
+            taken = elapsed_ms(start);
+            total_ms += taken;
+            total_nodes += search_stats.nodes;
+            printf(
+                "threads %3d position %d depth %2d %8ldms %12lu nodes %10.0f nps\n",
+                threads, i + 1, result.depth, taken, search_stats.nodes,
+                search_stats.nodes * 1000.0 / (taken ? taken : 1)
+            );
+        }
+        if(threads == 1)
+            single_thread_ms = total_ms;
+        printf(
+            "threads %3d total %8ldms to depth %d, %10.0f nps, speedup %.2f\n\n",
+            threads, total_ms, limits.max_depth,
+            total_nodes * 1000.0 / (total_ms ? total_ms : 1),
+            (double)single_thread_ms / (total_ms ? total_ms : 1)
+        );
+    }
+    return 0;
+}
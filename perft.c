@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "toychess.c"
+
+/*
+ * Performance test (perft) for the move generator. Walks the tree of legal
+ * moves to a fixed depth and counts the leaf nodes, which can be checked
+ * against published figures for well known positions, and reports how many
+ * nodes per second legal_moves_for_board and apply_move can sustain.
+ */
+
+#define MAX_PERFT_DEPTH 6
+
+typedef struct {
+    const char *name;
+    const char *fen;
+    // expected leaf nodes indexed by depth - 1, zero where we don't know
+    uint64_t nodes[MAX_PERFT_DEPTH];
+} PerftPosition;
+
+// https://www.chessprogramming.org/Perft_Results
+static const PerftPosition REFERENCE_POSITIONS[] = {
+    {
+        "startpos",
+        START_POS_FEN,
+        {20, 400, 8902, 197281, 4865609, 119060324}
+    },
+    {
+        "kiwipete",
+        KIWIPETE_FEN,
+        {48, 2039, 97862, 4085603, 193690690, 0}
+    },
+    {
+        "pos3",
+        "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+        {14, 191, 2812, 43238, 674624, 11030083}
+    },
+    {
+        "pos4",
+        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+        {6, 264, 9467, 422333, 15833292, 0}
+    },
+    {
+        "pos5",
+        "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+        {44, 1486, 62379, 2103487, 89941194, 0}
+    },
+    {
+        "pos6",
+        "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+        {46, 2079, 89890, 3894594, 164075551, 0}
+    },
+};
+
+#define REFERENCE_POSITION_COUNT \
+    (int)(sizeof(REFERENCE_POSITIONS) / sizeof(PerftPosition))
+
+typedef struct {
+    // key ^ data, so a torn write from another thread fails the lookup
+    uint64_t check;
+    // leaf count in the low 56 bits, depth in the top 8
+    uint64_t data;
+} PerftEntry;
+
+typedef struct {
+    Bitboard board;
+    int depth;
+    MoveList move_list;
+    uint64_t nodes[MAX_MOVES];
+    atomic_int next_move;
+} RootSplit;
+
+static PerftEntry *perft_table = NULL;
+static uint64_t perft_table_mask = 0;
+// move generator under test, -r swaps in the copy-make reference
+static void (*generate_moves)(MoveList *, Bitboard) = legal_moves_for_board;
+
+void perft_table_init(size_t megabytes);
+bool perft_table_probe(uint64_t key, int depth, uint64_t *nodes);
+void perft_table_store(uint64_t key, int depth, uint64_t nodes);
+uint64_t perft(Bitboard *board, int depth);
+void *perft_worker(void *arg);
+uint64_t perft_divide(Bitboard board, int depth, int threads, bool verbose);
+void move_coordinates(Move move, char *buffer);
+double elapsed_seconds(struct timespec start);
+int run_suite(int max_depth, int threads);
+void usage(const char *program);
+
+
+void perft_table_init(size_t megabytes)
+{
+    // round the table down to a power of two so we can mask the key
+    size_t entries = 1;
+    while(entries * 2 * sizeof(PerftEntry) <= megabytes * 1024 * 1024)
+        entries *= 2;
+    perft_table = calloc(entries, sizeof(PerftEntry));
+    if(perft_table == NULL) {
+        fprintf(stderr, "unable to allocate %zuMB perft table\n", megabytes);
+        exit(1);
+    }
+    perft_table_mask = entries - 1;
+}
+
+
+bool perft_table_probe(uint64_t key, int depth, uint64_t *nodes)
+{
+    PerftEntry *entry = &perft_table[key & perft_table_mask];
+    uint64_t data = entry->data;
+    if((entry->check ^ data) != key || (int)(data >> 56) != depth)
+        return false;
+    *nodes = data & (((uint64_t)1 << 56) - 1);
+    return true;
+}
+
+
+void perft_table_store(uint64_t key, int depth, uint64_t nodes)
+{
+    PerftEntry *entry = &perft_table[key & perft_table_mask];
+    uint64_t data = nodes | ((uint64_t)depth << 56);
+    entry->check = key ^ data;
+    entry->data = data;
+}
+
+
+uint64_t perft(Bitboard *board, int depth)
+{
+    MoveList move_list;
+    Undo undo;
+    uint64_t nodes = 0;
+    uint64_t key = 0;
+    int i;
+
+    if(depth == 0)
+        return 1;
+    if(perft_table != NULL && depth > 1) {
+        key = board->hash;
+        if(perft_table_probe(key, depth, &nodes))
+            return nodes;
+    }
+    generate_moves(&move_list, *board);
+    if(depth == 1) {
+        // bulk count, the leaves don't need to be made
+        return move_list.count;
+    }
+    for(i = 0; i < move_list.count; i++) {
+        make_move(board, move_list.moves[i], &undo);
+        nodes += perft(board, depth - 1);
+        unmake_move(board, move_list.moves[i], &undo);
+    }
+    if(perft_table != NULL)
+        perft_table_store(key, depth, nodes);
+    return nodes;
+}
+
+
+void *perft_worker(void *arg)
+{
+    // take root moves off the shared counter until there are none left
+    RootSplit *split = arg;
+    Bitboard tmp_board;
+    int idx;
+    while((idx = atomic_fetch_add(&split->next_move, 1)) < split->move_list.count) {
+        tmp_board = split->board;
+        apply_move(&tmp_board, split->move_list.moves[idx]);
+        split->nodes[idx] = perft(&tmp_board, split->depth - 1);
+    }
+    return NULL;
+}
+
+
+uint64_t perft_divide(Bitboard board, int depth, int threads, bool verbose)
+{
+    /*
+     * Count the leaves below each root move, splitting the root moves
+     * between threads. With verbose set print the per-move "divide" counts,
+     * which can be diffed against another engine to find a bad move
+     */
+    static RootSplit split;
+    pthread_t workers[threads];
+    char coordinates[6];
+    uint64_t total = 0;
+    int i;
+
+    split.board = board;
+    split.depth = depth;
+    atomic_init(&split.next_move, 0);
+    generate_moves(&split.move_list, board);
+
+    for(i = 0; i < threads; i++)
+        pthread_create(&workers[i], NULL, perft_worker, &split);
+    for(i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+
+    for(i = 0; i < split.move_list.count; i++) {
+        if(verbose) {
+            move_coordinates(split.move_list.moves[i], coordinates);
+            printf("%s: %lu\n", coordinates, split.nodes[i]);
+        }
+        total += split.nodes[i];
+    }
+    return total;
+}
+
+
+void move_coordinates(Move move, char *buffer)
+{
+    // long algebraic e.g. e7e8q, which other engines use for divide output
+    strcpy(buffer, SQUARE_NAMES[bitscan(move.src)]);
+    strcat(buffer, SQUARE_NAMES[bitscan(move.dst)]);
+    if(move.special & PROMOTE_QUEEN) {
+        strcat(buffer, "q");
+    } else if(move.special & PROMOTE_ROOK) {
+        strcat(buffer, "r");
+    } else if(move.special & PROMOTE_KNIGHT) {
+        strcat(buffer, "n");
+    } else if(move.special & PROMOTE_BISHOP) {
+        strcat(buffer, "b");
+    }
+}
+
+
+double elapsed_seconds(struct timespec start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+
+int run_suite(int max_depth, int threads)
+{
+    // perft every reference position up to max_depth, exit code is failures
+    struct timespec start;
+    double seconds;
+    uint64_t nodes;
+    uint64_t expected;
+    int failures = 0;
+    int i;
+    int depth;
+
+    for(i = 0; i < REFERENCE_POSITION_COUNT; i++) {
+        Bitboard board = fen_to_board(REFERENCE_POSITIONS[i].fen);
+        for(depth = 1; depth <= max_depth && depth <= MAX_PERFT_DEPTH; depth++) {
+            expected = REFERENCE_POSITIONS[i].nodes[depth - 1];
+            if(!expected)
+                continue;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            nodes = perft_divide(board, depth, threads, false);
+            seconds = elapsed_seconds(start);
+            printf(
+                "%-10s depth %d %12lu nodes %8.3fs %12.0f nps  %s\n",
+                REFERENCE_POSITIONS[i].name, depth, nodes, seconds,
+                nodes / seconds, nodes == expected ? "OK" : "FAIL"
+            );
+            if(nodes != expected) {
+                printf("  expected %lu\n", expected);
+                failures++;
+            }
+        }
+    }
+    return failures;
+}
+
+
+void usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [-r] [-t threads] [-H hash_mb] <fen|name> <depth>\n", program);
+    fprintf(stderr, "       %s [-r] [-t threads] [-H hash_mb] -s [max_depth]\n", program);
+    fprintf(stderr, "\n-r uses the reference copy-make move generator\n");
+    fprintf(stderr, "\nnamed positions:");
+    for(int i = 0; i < REFERENCE_POSITION_COUNT; i++)
+        fprintf(stderr, " %s", REFERENCE_POSITIONS[i].name);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+    struct timespec start;
+    const char *fen;
+    double seconds;
+    uint64_t nodes;
+    bool suite = false;
+    int threads = 1;
+    int depth;
+    int opt;
+    int i;
+
+    init_tables();
+    while((opt = getopt(argc, argv, "t:H:sr")) != -1) {
+        switch(opt) {
+            case 'r':
+                generate_moves = legal_moves_for_board_reference;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'H':
+                perft_table_init(atoi(optarg));
+                break;
+            case 's':
+                suite = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(threads < 1)
+        usage(argv[0]);
+    if(suite)
+        return run_suite(optind < argc ? atoi(argv[optind]) : 4, threads);
+    if(argc - optind != 2)
+        usage(argv[0]);
+
+    // accept either a named reference position or a FEN string
+    fen = argv[optind];
+    for(i = 0; i < REFERENCE_POSITION_COUNT; i++) {
+        if(strcmp(fen, REFERENCE_POSITIONS[i].name) == 0)
+            fen = REFERENCE_POSITIONS[i].fen;
+    }
+    depth = atoi(argv[optind + 1]);
+    if(depth < 1)
+        usage(argv[0]);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    nodes = perft_divide(fen_to_board(fen), depth, threads, true);
+    seconds = elapsed_seconds(start);
+    printf("\nnodes: %lu\ntime: %.3fs\nnps: %.0f\n", nodes, seconds, nodes / seconds);
+    return 0;
+}
@@ -1,6 +1,11 @@
 #include <stdio.h>
+#include <unistd.h>
 #include "toychess.c"
 
+// each side's clock, 15 minutes plus 10 seconds a move
+#define GAME_TIME_MS (15 * 60 * 1000)
+#define GAME_INCREMENT_MS (10 * 1000)
+
 Move human_mover(Bitboard board)
 {
     // Mover implementation for a real human player
@@ -8,16 +13,16 @@ Move human_mover(Bitboard board)
     char algebra[20];
     char *help_buffer;
     int idx;
+    MoveList move_list;
     Move result = {};
     while(result.dst == EMPTY_BOARD) {
         printf("\nEnter your move > ");
         fgets(inbuff, 20, stdin);
         if(strcmp(inbuff, "help\n") == 0) {
             // give the player a hand and list available moves
-            Move *move_list = legal_moves_for_board(board);
-            idx = 1;
-            while(move_list != NULL) {
-                help_buffer = algebra_for_move(board, *move_list);
+            legal_moves_for_board(&move_list, board);
+            for(idx = 1; idx <= move_list.count; idx++) {
+                help_buffer = algebra_for_move(board, move_list.moves[idx - 1]);
                 printf("%s", help_buffer);
                 if(idx % 5 == 0) {
                     printf("\n");
@@ -25,8 +30,6 @@ Move human_mover(Bitboard board)
                     printf("\t");
                 }
                 free(help_buffer);
-                move_list = move_list->next;
-                idx ++;
             }
             printf("\n\n");
             print_board(board);
@@ -40,10 +43,32 @@ Move human_mover(Bitboard board)
 }
 
 
-int main()
+int main(int argc, char **argv)
 {
+    // -H sets the transposition table size in MB, -t the search threads
+    size_t hash_mb = TT_DEFAULT_MB;
+    int opt;
+    init_tables();
+    while((opt = getopt(argc, argv, "t:H:")) != -1) {
+        switch(opt) {
+            case 't':
+                search_threads = atoi(optarg);
+                break;
+            case 'H':
+                hash_mb = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t threads] [-H hash_mb]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(search_threads < 1 || search_threads > MAX_SEARCH_THREADS) {
+        fprintf(stderr, "threads must be 1 to %d\n", MAX_SEARCH_THREADS);
+        return 2;
+    }
+    tt_init(hash_mb);
     printf("****************\nWELCOME TO CHESS\n****************\n\n");
     printf("Human plays black. Input is (almost) PGN standard algebraic\n");
     printf("notation\n\nType 'help' to list available moves.\n\n");
-    match_player(negamax_mover, human_mover);
+    match_player(negamax_mover, human_mover, GAME_TIME_MS, GAME_INCREMENT_MS);
 }
@@ -6,9 +6,17 @@
 int assert_board_eq(uint64_t a, uint64_t b, const char *message);
 int assert_true(bool condition, const char *message);
 uint64_t sq_map(int location);
+void walk_two_plies(const char *fen, void (*check)(Bitboard *board));
+void check_mailbox(Bitboard *board);
+void check_legal_move_count(Bitboard *board);
+void check_zobrist_key(Bitboard *board);
+void check_gives_check(Bitboard *board);
 void test_king_attacks();
 void test_rook_attacks();
+void test_slider_tables();
 void test_knight_attacks();
+void test_leaper_tables();
+void test_bit_counting();
 void test_pawn_attacks();
 void test_pawn_moves();
 void test_queen_collisions();
@@ -21,16 +29,43 @@ void test_escape_check();
 void test_src_pieces();
 void test_parse_algebra();
 void test_move_count();
+void test_generator_matches_reference();
+void test_unmake_move();
+void test_packed_moves();
+void test_zobrist_incremental();
+void test_count_legal_moves();
+void test_alphabeta_matches_negamax();
+void test_centipawn_scores();
+void test_transposition_table();
+void test_move_ordering();
+void test_static_exchange();
+void test_capture_generation();
+void test_iterative_deepening();
+void test_principal_variation();
+void test_selective_search();
+void test_search_stack();
+void test_threaded_search();
+void test_allocate_time();
+void test_mailbox_in_sync();
+void test_eval_totals_in_sync();
+bool eval_totals_match(Bitboard board);
+bool mailbox_matches_bitboards(Bitboard board);
+bool boards_equal(Bitboard a, Bitboard b);
 void test_castling_move_generation();
+void test_castling_through_check();
 void test_enpassant();
 void test_pawn_promotion();
 
 
 int main()
 {
+    init_tables();
     test_king_attacks();
     test_rook_attacks();
+    test_slider_tables();
     test_knight_attacks();
+    test_leaper_tables();
+    test_bit_counting();
     test_queen_collisions();
     test_pawn_moves();
     test_pawn_attacks();
@@ -43,7 +78,27 @@ int main()
     test_src_pieces();
     test_parse_algebra();
     test_move_count();
+    test_generator_matches_reference();
+    test_unmake_move();
+    test_packed_moves();
+    test_zobrist_incremental();
+    test_count_legal_moves();
+    test_alphabeta_matches_negamax();
+    test_centipawn_scores();
+    test_transposition_table();
+    test_move_ordering();
+    test_static_exchange();
+    test_capture_generation();
+    test_iterative_deepening();
+    test_principal_variation();
+    test_selective_search();
+    test_search_stack();
+    test_threaded_search();
+    test_allocate_time();
+    test_mailbox_in_sync();
+    test_eval_totals_in_sync();
     test_castling_move_generation();
+    test_castling_through_check();
     test_enpassant();
     test_pawn_promotion();
     return 0;
@@ -135,6 +190,96 @@ void test_rook_attacks()
 }
 
 
+void test_slider_tables()
+{
+    /* compare the table lookups against the reference shift loops for
+     * every square with random blockers */
+    uint64_t seed = 1;
+    uint64_t occupied;
+    int sq;
+    int i;
+    for(sq = 0; sq < 64; sq++) {
+        for(i = 0; i < 100; i++) {
+            occupied = xorshift64(&seed) & xorshift64(&seed);
+            assert_board_eq(
+                rook_attacks_sq(sq, occupied),
+                rook_attacks_loop(sq_map(sq), occupied, EMPTY_BOARD),
+                "rook table lookup matches reference"
+            );
+            assert_board_eq(
+                bishop_attacks_sq(sq, occupied),
+                bishop_attacks_loop(sq_map(sq), occupied, EMPTY_BOARD),
+                "bishop table lookup matches reference"
+            );
+        }
+    }
+}
+
+
+void test_bit_counting()
+{
+    /* the hardware and fallback versions agree, run both whatever the
+     * CPU supports */
+    bool has_popcnt = CPU_HAS_POPCNT;
+    bool has_lzcnt = CPU_HAS_LZCNT;
+    bool has_tzcnt = CPU_HAS_TZCNT;
+    uint64_t seed = 12345;
+    uint64_t b;
+    uint64_t b_fallback;
+    int count;
+    int first;
+    int last;
+    assert_true(bitscan(sq_map(a1) | sq_map(h8)) == a1, "bitscan finds a1 first");
+    assert_true(population_count(RANK_1 | FILE_A) == 15, "rank and file count");
+    for(int i = 0; i < 1000; i++) {
+        b = xorshift64(&seed) & xorshift64(&seed);
+        if(!b)
+            continue;
+        b_fallback = b;
+        CPU_HAS_POPCNT = CPU_HAS_LZCNT = CPU_HAS_TZCNT = false;
+        count = population_count(b);
+        first = bitscan(b);
+        last = pop_square(&b_fallback);
+        CPU_HAS_POPCNT = has_popcnt;
+        CPU_HAS_LZCNT = has_lzcnt;
+        CPU_HAS_TZCNT = has_tzcnt;
+        assert_true(population_count(b) == count, "popcount matches fallback");
+        assert_true(bitscan(b) == first, "bitscan matches fallback");
+        assert_true(pop_square(&b) == last, "pop_square matches fallback");
+        assert_true(b == b_fallback, "pop_square clears the same bit");
+    }
+}
+
+
+void test_leaper_tables()
+{
+    /* the per square tables agree with the set-wise shifts */
+    int sq;
+    for(sq = 0; sq < 64; sq++) {
+        assert_board_eq(
+            knight_attacks_sq(sq),
+            knight_attacks(sq_map(sq), EMPTY_BOARD, EMPTY_BOARD),
+            "knight table matches shifts"
+        );
+        assert_board_eq(
+            king_attacks_sq(sq),
+            king_attacks(sq_map(sq), EMPTY_BOARD, EMPTY_BOARD),
+            "king table matches shifts"
+        );
+        assert_board_eq(
+            pawn_attacks_sq(sq, false),
+            pawn_attacks(sq_map(sq), ~EMPTY_BOARD),
+            "white pawn table matches shifts"
+        );
+    }
+    assert_board_eq(
+        pawn_attacks_sq(e4, true),
+        sq_map(d3) | sq_map(f3),
+        "black pawns attack to the south"
+    );
+}
+
+
 void test_knight_attacks()
 {
     uint64_t knights = sq_map(e4);
@@ -300,15 +445,19 @@ void test_in_check()
     Bitboard testboard;
     testboard = fen_to_board(not_in_check);
     assert_true(
-        !in_check(testboard),
+        !in_check(testboard, true),
         "Correctly detect board is not in check"
     );
     // Test a board that is in check and fail if we don't
     testboard = fen_to_board(check);
     assert_true(
-        in_check(testboard),
+        in_check(testboard, true),
         "Correctly detect board is in check"
     );
+    assert_true(
+        !in_check(testboard, false),
+        "White isn't in check from black"
+    );
 }
 
 void test_escape_check()
@@ -385,6 +534,31 @@ uint64_t sq_map(int location)
 }
 
 
+void walk_two_plies(const char *fen, void (*check)(Bitboard *board))
+{
+    /* call check on the position and every one reached from it in one or
+     * two plies, made and unmade on the same board */
+    Bitboard board = fen_to_board(fen);
+    MoveList first;
+    MoveList second;
+    Undo undo_first;
+    Undo undo_second;
+    check(&board);
+    legal_moves_for_board(&first, board);
+    for(int i = 0; i < first.count; i++) {
+        make_move(&board, first.moves[i], &undo_first);
+        check(&board);
+        legal_moves_for_board(&second, board);
+        for(int j = 0; j < second.count; j++) {
+            make_move(&board, second.moves[j], &undo_second);
+            check(&board);
+            unmake_move(&board, second.moves[j], &undo_second);
+        }
+        unmake_move(&board, first.moves[i], &undo_first);
+    }
+}
+
+
 void test_src_pieces()
 {
     // https://chess.stackexchange.com/questions/1817/how-are-pgn-ambiguities-handled
@@ -493,12 +667,689 @@ void test_parse_algebra()
 void test_move_count()
 {
     Bitboard testboard = fen_to_board(START_POS_FEN);
-    Move *move_list = legal_moves_for_board(testboard);
+    MoveList move_list;
+    legal_moves_for_board(&move_list, testboard);
     assert_true(
-        move_list_count(move_list) == 20,
+        move_list.count == 20,
         "20 opening moves are available"
     );
-    move_list_delete(&move_list);
+}
+
+
+void test_generator_matches_reference()
+{
+    /* the pin and check mask generator agrees with the copy-make reference
+     * in tricky positions and every position one move on */
+    const char *fens[] = {
+        KIWIPETE_FEN,
+        "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+        "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8"
+    };
+    MoveList move_list;
+    MoveList reference;
+    MoveList reply;
+    Bitboard testboard;
+    Bitboard tmp_board;
+    int i;
+    int j;
+    for(i = 0; i < 4; i++) {
+        testboard = fen_to_board(fens[i]);
+        legal_moves_for_board(&move_list, testboard);
+        legal_moves_for_board_reference(&reference, testboard);
+        assert_true(
+            move_list.count == reference.count,
+            "Same number of moves as the reference generator"
+        );
+        for(j = 0; j < move_list.count; j++) {
+            tmp_board = testboard;
+            apply_move(&tmp_board, move_list.moves[j]);
+            legal_moves_for_board(&reply, tmp_board);
+            legal_moves_for_board_reference(&reference, tmp_board);
+            assert_true(
+                reply.count == reference.count,
+                "Same number of replies as the reference generator"
+            );
+        }
+    }
+}
+
+
+bool boards_equal(Bitboard a, Bitboard b)
+{
+    return a.pawns == b.pawns && a.knights == b.knights
+        && a.bishops == b.bishops && a.rooks == b.rooks
+        && a.queens == b.queens && a.kings == b.kings
+        && a.whites == b.whites && a.black_move == b.black_move
+        && a.castle_wks == b.castle_wks && a.castle_wqs == b.castle_wqs
+        && a.castle_bks == b.castle_bks && a.castle_bqs == b.castle_bqs
+        && a.halfmove_clock == b.halfmove_clock
+        && a.fullmove_clock == b.fullmove_clock
+        && a.enpassant == b.enpassant
+        && memcmp(a.piece, b.piece, sizeof(a.piece)) == 0;
+}
+
+
+bool mailbox_matches_bitboards(Bitboard board)
+{
+    // rebuild each square's piece from the bitboards and compare
+    uint64_t target;
+    int expected;
+    for(int sq = 0; sq < 64; sq++) {
+        target = SQUARE_0 >> sq;
+        expected = 0;
+        for(int piece = PAWN; piece <= KING; piece++) {
+            if(*piece_bitboard(&board, piece) & target)
+                expected = piece | (board.whites & target ? WHITE : 0);
+        }
+        if(board.piece[sq] != expected)
+            return false;
+    }
+    return true;
+}
+
+
+void check_mailbox(Bitboard *board)
+{
+    assert_true(mailbox_matches_bitboards(*board), "mailbox follows make_move");
+    assert_true(eval_totals_match(*board), "totals follow make_move");
+}
+
+
+void test_mailbox_in_sync()
+{
+    /* play two plies of every line from a position with castling,
+     * en-passant and promotions available and check the mailbox, and the
+     * evaluation totals kept alongside it */
+    const char *fen = "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1";
+    Bitboard testboard = fen_to_board(fen);
+    walk_two_plies(fen, check_mailbox);
+    assert_true(
+        mailbox_matches_bitboards(enemy_board(testboard)),
+        "mailbox follows enemy_board"
+    );
+    assert_true(eval_totals_match(enemy_board(testboard)), "totals follow enemy_board");
+}
+
+
+bool eval_totals_match(Bitboard board)
+{
+    // the running totals against a sum from scratch
+    Bitboard fresh = board;
+    init_eval_totals(&fresh);
+    return memcmp(board.material, fresh.material, sizeof(board.material)) == 0
+        && memcmp(board.pst, fresh.pst, sizeof(board.pst)) == 0
+        && board.phase == fresh.phase;
+}
+
+
+void test_eval_totals_in_sync()
+{
+    /* the totals at the start, and unmake_move putting them back as they
+     * were. test_mailbox_in_sync checks them through two plies */
+    Bitboard testboard = fen_to_board(START_POS_FEN);
+    Bitboard original;
+    MoveList move_list;
+    Undo undo;
+    assert_true(
+        testboard.material[0] == testboard.material[1]
+            && testboard.phase == MAX_PHASE,
+        "start position totals"
+    );
+    testboard = fen_to_board(
+        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1"
+    );
+    original = testboard;
+    legal_moves_for_board(&move_list, testboard);
+    for(int i = 0; i < move_list.count; i++) {
+        make_move(&testboard, move_list.moves[i], &undo);
+        unmake_move(&testboard, move_list.moves[i], &undo);
+    }
+    assert_true(
+        memcmp(testboard.material, original.material, sizeof(original.material)) == 0
+            && memcmp(testboard.pst, original.pst, sizeof(original.pst)) == 0
+            && testboard.phase == original.phase,
+        "unmake restores the totals"
+    );
+}
+
+
+void test_alphabeta_matches_negamax()
+{
+    // pruning must not change the root score, only the work done
+    const char *fens[] = {
+        START_POS_FEN,
+        KIWIPETE_FEN,
+        "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+        "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8"
+    };
+    Bitboard testboard;
+    SearchResult result;
+    SearchOptions options = search_options;
+    // only the full width search is exact
+    search_options = (SearchOptions){false, false, false};
+    // negamax starts a full window quiescence search at every leaf, so
+    // keep the depth low
+    for(int i = 0; i < 4; i++) {
+        testboard = fen_to_board(fens[i]);
+        result = search_root(testboard, 2);
+        assert_true(
+            result.score == negamax(&testboard, 2, 0),
+            "alpha-beta scores the root the same as negamax"
+        );
+        assert_true(result.best_move.dst != EMPTY_BOARD, "a best move is found");
+    }
+    search_options = options;
+}
+
+
+void test_centipawn_scores()
+{
+    /* the evaluation in centipawns, and mates scored by how far off they
+     * are, the same whether found by search or through the table */
+    Bitboard testboard = fen_to_board(START_POS_FEN);
+    SearchResult result;
+    assert_true(eval_shannon(testboard) == 0, "start position is level");
+    /* a rook up, attacking 9 squares and black nothing, which happens to
+     * match 14 legal moves to black's 5 */
+    testboard = fen_to_board("4k3/8/8/8/8/8/8/4K2R w - - 0 1");
+    assert_true(eval_shannon(testboard) == 590, "rook and mobility");
+    eval_options.legal_mobility = true;
+    assert_true(eval_shannon(testboard) == 590, "rook and legal move mobility");
+    // after 1.e4 the en-passant square is black's to use, not white's
+    assert_true(
+        eval_shannon(fen_to_board(
+            "rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq e3 0 1"
+        )) == eval_shannon(fen_to_board(
+            "rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq - 0 1"
+        )),
+        "legal mobility ignores the other side's en-passant"
+    );
+    eval_options.legal_mobility = false;
+    // the knight's 8 squares less e4, covered by the pawn
+    testboard = fen_to_board("4k3/8/8/3p4/8/2N5/8/4K3 w - - 0 1");
+    assert_true(attack_mobility(testboard, false) == 7, "knight's safe squares");
+    assert_true(attack_mobility(testboard, true) == 0, "pawns aren't counted");
+    testboard = fen_to_board("6k1/5ppp/8/8/8/8/5PPP/R5K1 w - - 0 1");
+    result = search_root(testboard, 3);
+    assert_true(result.score == MATE_SCORE - 1, "mate in one");
+    assert_true(result.best_move.dst == sq_map(a8), "the rook mates");
+    tt_init(1);
+    result = search_root(testboard, 5);
+    assert_true(result.score == MATE_SCORE - 1, "mate in one through the table");
+    tt_init(0);
+    assert_true(score_from_tt(score_to_tt(-MATE_SCORE + 7, 3), 3) == -MATE_SCORE + 7,
+        "mate scores round trip the table");
+    testboard = fen_to_board("7k/5Q2/6K1/8/8/8/8/8 b - - 0 1");
+    assert_true(negamax(&testboard, 1, 0) == 0, "stalemate is a draw");
+}
+
+
+void test_iterative_deepening()
+{
+    /* iterations end on the depth limit with the fixed depth's score, and
+     * on the hard limit with the last complete iteration */
+    Bitboard testboard = fen_to_board(KIWIPETE_FEN);
+    SearchLimits depth_limited = {3, 100000, 100000};
+    SearchLimits time_limited = {MAX_SEARCH_DEPTH, 100000, 200};
+    SearchResult result;
+    struct timespec start;
+    long taken;
+    result = search_iterative(testboard, depth_limited);
+    assert_true(result.depth == 3, "stops at the depth limit");
+    assert_true(
+        result.score == search_root(testboard, 3).score,
+        "deepening reaches the fixed depth score"
+    );
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    result = search_iterative(testboard, time_limited);
+    taken = elapsed_ms(start);
+    assert_true(taken < 300, "hard limit aborts the search");
+    assert_true(result.depth >= 1 && result.best_move.dst, "a move is returned");
+}
+
+
+void test_principal_variation()
+{
+    /* the line returned starts with the best move, runs to the search
+     * depth without the table cutting it short and is legal throughout */
+    Bitboard testboard = fen_to_board(KIWIPETE_FEN);
+    SearchLimits limits = {5, 100000, 100000};
+    SearchResult result;
+    MoveList move_list;
+    Move move;
+    bool found;
+    tt_init(0);
+    result = search_root(testboard, 4);
+    assert_true(result.pv_length == 4, "pv reaches the search depth");
+    assert_true(
+        result.pv[0] == pack_move(result.best_move),
+        "pv starts with the best move"
+    );
+    for(int i = 0; i < result.pv_length; i++) {
+        legal_moves_for_board(&move_list, testboard);
+        found = false;
+        for(int j = 0; j < move_list.count; j++)
+            found |= pack_move(move_list.moves[j]) == result.pv[i];
+        assert_true(found, "every pv move is legal");
+        move = unpack_move(result.pv[i]);
+        apply_move(&testboard, move);
+    }
+    // aspiration windows still end on the full window score
+    testboard = fen_to_board(KIWIPETE_FEN);
+    result = search_iterative(testboard, limits);
+    assert_true(
+        result.score == search_root(testboard, 5).score,
+        "aspiration search scores the same as the full window"
+    );
+    assert_true(result.pv[0] == pack_move(result.best_move), "deepened pv");
+    // the table mustn't cut the line short either
+    tt_init(1);
+    limits.max_depth = 8;
+    result = search_iterative(fen_to_board(START_POS_FEN), limits);
+    assert_true(result.pv_length == 8, "pv reaches the depth through the table");
+    tt_init(0);
+}
+
+
+void check_gives_check(Bitboard *board)
+{
+    // gives_check agrees with making each move
+    MoveList move_list;
+    Bitboard after;
+    legal_moves_for_board(&move_list, *board);
+    for(int i = 0; i < move_list.count; i++) {
+        after = *board;
+        apply_move(&after, move_list.moves[i]);
+        assert_true(
+            gives_check(board, move_list.moves[i]) == in_check(after, after.black_move),
+            "gives_check matches making the move"
+        );
+    }
+}
+
+
+void test_selective_search()
+{
+    /* passing the move keeps the key in step, checks are seen without
+     * making the move, each pruning cuts the nodes searched to a depth,
+     * and null moves aren't tried with only pawns left */
+    Bitboard testboard;
+    Bitboard original;
+    SearchOptions options = search_options;
+    SearchOptions single[3] = {
+        {true, false, false}, {false, true, false}, {false, false, true}
+    };
+    uint64_t full_width_nodes;
+    const char *check_fens[] = {
+        KIWIPETE_FEN,
+        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+        "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8"
+    };
+    Undo undo;
+    testboard = fen_to_board("rnbqkbnr/ppp1p1pp/8/3pPp2/8/8/PPPP1PPP/RNBQKBNR w KQkq f6 0 3");
+    original = testboard;
+    make_null_move(&testboard, &undo);
+    assert_true(testboard.black_move && !testboard.enpassant, "null move passes");
+    assert_true(testboard.hash == zobrist_key(testboard), "null move hash");
+    unmake_null_move(&testboard, &undo);
+    assert_true(boards_equal(testboard, original), "null move is taken back");
+    for(int i = 0; i < 3; i++)
+        walk_two_plies(check_fens[i], check_gives_check);
+    testboard = fen_to_board(KIWIPETE_FEN);
+    tt_init(0);
+    search_options = (SearchOptions){false, false, false};
+    search_root(testboard, 4);
+    full_width_nodes = search_stats.nodes;
+    for(int i = 0; i < 3; i++) {
+        search_options = single[i];
+        search_root(testboard, 4);
+        assert_true(search_stats.nodes < full_width_nodes, "pruning saves nodes");
+    }
+    search_options = (SearchOptions){true, false, false};
+    search_root(fen_to_board("8/5pk1/6p1/8/8/6P1/5PK1/8 w - - 0 1"), 5);
+    assert_true(search_stats.null_move_cutoffs == 0, "no null moves with only pawns");
+    search_options = options;
+}
+
+
+void test_search_stack()
+{
+    /* the search stays within its preallocated stack: the quiescence
+     * search stops at MAX_PLY, and deeper limits are cut to it */
+    Bitboard testboard = fen_to_board(KIWIPETE_FEN);
+    SearchLimits limits = {1000, 100000, 100000};
+    SearchResult result;
+    int score;
+    search_reset();
+    score = quiescence(&testboard, MAX_PLY - 1, -INFINITE_SCORE, INFINITE_SCORE);
+    assert_true(score > -MATE_BOUND && score < MATE_BOUND, "quiescence at the last ply");
+    // bare kings search quickly however deep, with the table
+    tt_init(1);
+    result = search_iterative(fen_to_board("8/8/8/4k3/8/8/8/4K3 w - - 0 1"), limits);
+    assert_true(result.depth == MAX_PLY, "depth is limited to the stack");
+    assert_true(result.pv_length <= MAX_PLY, "pv fits the stack");
+    tt_init(0);
+}
+
+
+void test_threaded_search()
+{
+    /* a torn table entry is rejected, and helper threads searching
+     * alongside still give a move and count their nodes */
+    Bitboard testboard = fen_to_board(KIWIPETE_FEN);
+    SearchLimits limits = {5, 100000, 100000};
+    SearchResult result;
+    uint64_t single_thread_nodes;
+    int score = negamax(&testboard, 2, 0);
+    TTEntry entry;
+    Move move = {sq_map(e2), sq_map(a6), 0};
+    tt_init(1);
+    tt_store(testboard.hash, 3, BOUND_EXACT, 50, move);
+    TT[testboard.hash & TT_MASK].slots[0].data ^= 1;
+    assert_true(!tt_probe(testboard.hash, &entry), "torn entry is rejected");
+    tt_clear();
+    result = search_iterative(testboard, limits);
+    single_thread_nodes = search_stats.nodes;
+    tt_clear();
+    search_threads = 3;
+    result = search_iterative(testboard, limits);
+    search_threads = 1;
+    assert_true(result.depth == 5 && result.best_move.dst, "threads find a move");
+    assert_true(
+        search_stats.nodes > single_thread_nodes / 2,
+        "helper nodes are counted"
+    );
+    assert_true(
+        score != 0 && negamax(&testboard, 2, 0) == score,
+        "the search runs again once the helpers stop"
+    );
+    tt_init(0);
+}
+
+
+void test_allocate_time()
+{
+    SearchLimits limits = allocate_time(60000, 1000, 0);
+    assert_true(limits.soft_ms > 0, "soft limit is allocated");
+    assert_true(limits.soft_ms <= limits.hard_ms, "soft limit within hard");
+    assert_true(limits.hard_ms <= 60000 / 5, "hard limit leaves time on the clock");
+    limits = allocate_time(10, 0, 0);
+    assert_true(limits.hard_ms >= 1 && limits.hard_ms < 10, "low on time");
+    limits = allocate_time(60000, 0, 2);
+    assert_true(limits.soft_ms > allocate_time(60000, 0, 40).soft_ms, "fewer moves to go get more time");
+}
+
+
+void test_capture_generation()
+{
+    /* the capture generator gives exactly the captures and promotions
+     * from the full list, or every evasion when in check */
+    const char *fens[] = {
+        KIWIPETE_FEN,
+        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 b kq - 0 1",
+        "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+        "8/8/8/2k5/2pP4/8/B7/4K3 b - d3 0 1"
+    };
+    Bitboard testboard;
+    MoveList all_moves;
+    MoveList captures;
+    int expected;
+    for(int i = 0; i < 4; i++) {
+        testboard = fen_to_board(fens[i]);
+        legal_moves_for_board(&all_moves, testboard);
+        legal_captures_for_board(&captures, testboard);
+        expected = 0;
+        for(int j = 0; j < all_moves.count; j++) {
+            if(is_capture(&testboard, all_moves.moves[j])
+                || (all_moves.moves[j].special & PROMOTE))
+                expected++;
+        }
+        if(in_check(testboard, testboard.black_move))
+            expected = all_moves.count;
+        assert_true(captures.count == expected, "captures and promotions only");
+        for(int j = 0; j < captures.count; j++) {
+            assert_true(
+                is_capture(&testboard, captures.moves[j])
+                    || (captures.moves[j].special & PROMOTE)
+                    || in_check(testboard, testboard.black_move),
+                "no quiet moves out of check"
+            );
+        }
+    }
+}
+
+
+void test_static_exchange()
+{
+    /* exchanges from the capturing side's point of view, including a
+     * rook joining in from behind another and a losing capture sorted
+     * after the quiet moves */
+    Bitboard testboard;
+    MoveList move_list;
+    int scores[MAX_MOVES];
+    Move move = {sq_map(e1), sq_map(e5), 0};
+    testboard = fen_to_board("1k1r4/1pp4p/p7/4p3/8/P5P1/1PP4P/2K1R3 w - - 0 1");
+    assert_true(see(&testboard, move) == 100, "undefended pawn is won");
+    testboard = fen_to_board("1k1r3q/1ppn3p/p4b2/4p3/8/P2N2P1/1PP1R1BP/2K1Q3 w - - 0 1");
+    move = (Move){sq_map(d3), sq_map(e5), 0};
+    assert_true(see(&testboard, move) == -200, "knight lost for a pawn");
+    testboard = fen_to_board("4k3/4r3/8/4p3/8/8/4R3/4R1K1 w - - 0 1");
+    move = (Move){sq_map(e2), sq_map(e5), 0};
+    assert_true(see(&testboard, move) == 100, "x-ray rook recaptures");
+    testboard = fen_to_board("4k3/8/8/3pP3/8/8/8/4K3 w - d6 0 2");
+    move = (Move){sq_map(e5), sq_map(d6), ENPASSANT};
+    assert_true(see(&testboard, move) == 100, "en-passant wins a pawn");
+    testboard = fen_to_board("4k3/4r3/8/4p3/8/3N4/8/4K3 w - - 0 1");
+    legal_moves_for_board(&move_list, testboard);
+    score_moves(&testboard, &move_list, scores, NO_MOVE, 0);
+    for(int i = 0; i < move_list.count; i++)
+        move = pick_move(&move_list, scores, i);
+    assert_true(move.src == sq_map(d3) && move.dst == sq_map(e5), "losing capture last");
+}
+
+
+void test_move_ordering()
+{
+    /* the hash move comes first, then captures with the most valuable
+     * victim and cheapest attacker, then everything else */
+    Bitboard testboard = fen_to_board("4k3/8/8/3q4/2P4r/5N2/8/K2R4 w - - 0 1");
+    MoveList move_list;
+    int scores[MAX_MOVES];
+    Move hash_move = {sq_map(a1), sq_map(b1), 0};
+    Move move;
+    legal_moves_for_board(&move_list, testboard);
+    score_moves(&testboard, &move_list, scores, pack_move(hash_move), 0);
+    move = pick_move(&move_list, scores, 0);
+    assert_true(move.src == sq_map(a1) && move.dst == sq_map(b1), "hash move first");
+    move = pick_move(&move_list, scores, 1);
+    assert_true(move.src == sq_map(c4) && move.dst == sq_map(d5), "pawn takes queen");
+    move = pick_move(&move_list, scores, 2);
+    assert_true(move.src == sq_map(d1) && move.dst == sq_map(d5), "rook takes queen");
+    move = pick_move(&move_list, scores, 3);
+    assert_true(move.dst == sq_map(h4), "then the rook is taken");
+    for(int i = 4; i < move_list.count; i++) {
+        move = pick_move(&move_list, scores, i);
+        assert_true(!is_capture(&testboard, move), "quiet moves come last");
+    }
+}
+
+
+void test_transposition_table()
+{
+    /* entries round trip and the table saves work without changing the
+     * move chosen at the root */
+    Bitboard testboard = fen_to_board(KIWIPETE_FEN);
+    SearchResult without_table;
+    SearchResult with_table;
+    uint64_t nodes_without_table;
+    TTEntry entry;
+    Move move = {sq_map(e2), sq_map(a6), 0};
+    assert_true(sizeof(TTBucket) == 64, "a bucket fills a cache line");
+    tt_init(1);
+    assert_true(!tt_probe(testboard.hash, &entry), "empty table misses");
+    tt_store(testboard.hash, 3, BOUND_LOWER, 150, move);
+    assert_true(tt_probe(testboard.hash, &entry), "stored position is found");
+    assert_true(
+        entry.depth == 3 && entry.bound == BOUND_LOWER && entry.score == 150
+            && entry.best_move == pack_move(move),
+        "entry holds what was stored"
+    );
+    entry.generation = 0xbeef;
+    assert_true(
+        tt_unpack_entry(tt_pack_entry(entry)).generation == 0xbeef,
+        "generation round trips"
+    );
+    // deep entries from the last search give way to shallow ones from this
+    for(uint64_t i = 0; i < TT_BUCKET_ENTRIES; i++)
+        tt_store(testboard.hash + (i << 32), 10, BOUND_EXACT, 0, move);
+    search_reset();
+    for(uint64_t i = 1; i <= TT_BUCKET_ENTRIES; i++)
+        tt_store(testboard.hash + (i << 48), 1, BOUND_EXACT, 0, move);
+    for(uint64_t i = 1; i <= TT_BUCKET_ENTRIES; i++)
+        assert_true(
+            tt_probe(testboard.hash + (i << 48), &entry),
+            "old entries are replaced first"
+        );
+    tt_init(0);
+    without_table = search_root(testboard, 4);
+    nodes_without_table = search_stats.nodes;
+    tt_init(1);
+    with_table = search_root(testboard, 4);
+    assert_true(
+        search_stats.nodes < nodes_without_table,
+        "transposition table reduces the nodes searched"
+    );
+    assert_true(search_stats.tt_hits > 0, "the search hits the table");
+    assert_true(
+        pack_move(with_table.best_move) == pack_move(without_table.best_move),
+        "same move is chosen with the table"
+    );
+    tt_init(0);
+}
+
+
+void check_legal_move_count(Bitboard *board)
+{
+    MoveList move_list;
+    legal_moves_for_board(&move_list, *board);
+    assert_true(
+        count_legal_moves(*board) == move_list.count,
+        "count_legal_moves matches the generator"
+    );
+    assert_true(
+        has_legal_move(*board) == (move_list.count > 0),
+        "has_legal_move matches the generator"
+    );
+}
+
+
+void test_count_legal_moves()
+{
+    /* counting agrees with the generator through two plies, which covers
+     * checks, pins, castling, promotions and en-passant */
+    const char *fens[] = {
+        KIWIPETE_FEN,
+        "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1"
+    };
+    Bitboard testboard;
+    for(int i = 0; i < 3; i++)
+        walk_two_plies(fens[i], check_legal_move_count);
+    // fool's mate and a king stalemated in the corner
+    testboard = fen_to_board("rnb1kbnr/pppp1ppp/8/4p3/6Pq/5P2/PPPPP2P/RNBQKBNR w KQkq - 1 3");
+    assert_true(!has_legal_move(testboard), "no moves when mated");
+    testboard = fen_to_board("7k/5Q2/6K1/8/8/8/8/8 b - - 0 1");
+    assert_true(!has_legal_move(testboard), "no moves when stalemated");
+    assert_true(count_legal_moves(testboard) == 0, "stalemate counts zero");
+}
+
+
+void check_zobrist_key(Bitboard *board)
+{
+    assert_true(board->hash == zobrist_key(*board), "hash follows make_move");
+}
+
+
+void test_zobrist_incremental()
+{
+    /* the key kept up by make_move matches one computed from scratch
+     * through two plies, and transposed move orders reach the same key */
+    Bitboard testboard;
+    Bitboard transposed;
+    walk_two_plies(KIWIPETE_FEN, check_zobrist_key);
+    // Nf3 Nf6 Nc3 against Nc3 Nf6 Nf3
+    testboard = fen_to_board(START_POS_FEN);
+    transposed = testboard;
+    apply_move(&testboard, parse_algebra(testboard, "Nf3"));
+    apply_move(&testboard, parse_algebra(testboard, "Nf6"));
+    apply_move(&testboard, parse_algebra(testboard, "Nc3"));
+    apply_move(&transposed, parse_algebra(transposed, "Nc3"));
+    apply_move(&transposed, parse_algebra(transposed, "Nf6"));
+    apply_move(&transposed, parse_algebra(transposed, "Nf3"));
+    assert_true(testboard.hash == transposed.hash, "transpositions share a key");
+    assert_true(
+        testboard.hash != fen_to_board(START_POS_FEN).hash,
+        "different positions have different keys"
+    );
+}
+
+
+void test_packed_moves()
+{
+    // every kind of move survives packing, and takes two bytes
+    Bitboard testboard = fen_to_board(
+        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 b kq - 0 1"
+    );
+    MoveList move_list;
+    Move move;
+    assert_true(sizeof(PackedMove) == 2, "packed moves are 16 bits");
+    legal_moves_for_board(&move_list, testboard);
+    for(int i = 0; i < move_list.count; i++) {
+        move = unpack_move(pack_move(move_list.moves[i]));
+        assert_true(
+            move.src == move_list.moves[i].src
+                && move.dst == move_list.moves[i].dst
+                && move.special == move_list.moves[i].special,
+            "move is unchanged by packing"
+        );
+        assert_true(pack_move(move) != NO_MOVE, "packed move isn't NO_MOVE");
+    }
+    move = (Move){sq_map(e1), sq_map(c1), CASTLE_QS};
+    assert_true(
+        unpack_move(pack_move(move)).special == CASTLE_QS,
+        "castling flag survives packing"
+    );
+}
+
+
+void test_unmake_move()
+{
+    /* every move, including castling, en-passant and promotions, is
+     * undone exactly for both colours */
+    const char *fens[] = {
+        KIWIPETE_FEN,
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/Pp2P3/2N2Q1p/1PPBBPPP/R3K2R b KQkq a3 0 1",
+        "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 b kq - 0 1"
+    };
+    MoveList move_list;
+    Bitboard testboard;
+    Bitboard original;
+    Undo undo;
+    int i;
+    int j;
+    for(i = 0; i < 3; i++) {
+        original = testboard = fen_to_board(fens[i]);
+        legal_moves_for_board(&move_list, testboard);
+        for(j = 0; j < move_list.count; j++) {
+            make_move(&testboard, move_list.moves[j], &undo);
+            unmake_move(&testboard, move_list.moves[j], &undo);
+            assert_true(
+                boards_equal(testboard, original),
+                "unmake_move restores the board"
+            );
+        }
+    }
 }
 
 
@@ -509,50 +1360,81 @@ void test_castling_move_generation()
     Bitboard testboard = fen_to_board(
         "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQK2R w KQkq - 0 1"
     );
-    Move *move_list = NULL;
+    MoveList move_list = {};
     legal_moves_castling(&move_list, testboard);
     assert_true(
-        move_list_count(move_list) == 1,
+        move_list.count == 1,
         "1 castling move available for white kingside"
     );
     // apply the move and check the results are as expected
-    apply_move(&testboard, *move_list);
+    apply_move(&testboard, move_list.moves[0]);
     assert_board_eq(
         testboard.rooks,
         sq_map(a8) | sq_map(h8) | sq_map(a1) | sq_map(f1),
         "Kingside rook has moved"
     );
     // check algebra looks realistic
-    algebra = algebra_for_move(testboard, *move_list);
+    algebra = algebra_for_move(testboard, move_list.moves[0]);
     assert_true(
         strcmp(algebra, "0-0") == 0,
         "Correct algebra for castling"
     );
     free(algebra);
-    move_list_delete(&move_list);
     // start again with white queenside
     testboard = fen_to_board(
         "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/R3KBNR w KQkq - 0 1"
     );
-    move_list = NULL;
+    move_list.count = 0;
     legal_moves_castling(&move_list, testboard);
     assert_true(
-        move_list_count(move_list) == 1,
+        move_list.count == 1,
         "1 castling move available for white queenside"
     );
-    apply_move(&testboard, *move_list);
+    apply_move(&testboard, move_list.moves[0]);
     assert_board_eq(
         testboard.rooks,
         sq_map(a8) | sq_map(h8) | sq_map(d1) | sq_map(h1),
         "Kingside rook has moved"
     );
-    algebra = algebra_for_move(testboard, *move_list);
+    algebra = algebra_for_move(testboard, move_list.moves[0]);
     assert_true(
         strcmp(algebra, "0-0-0") == 0,
         "Correct algebra for castling"
     );
     free(algebra);
-    move_list_delete(&move_list);
+}
+
+
+void test_castling_through_check()
+{
+    // black bishop on c4 covers f1, so white can only castle queenside
+    Bitboard testboard = fen_to_board(
+        "r3k2r/8/8/8/2b5/8/8/R3K2R w KQkq - 0 1"
+    );
+    MoveList move_list = {};
+    legal_moves_castling(&move_list, testboard);
+    assert_true(
+        move_list.count == 1 && move_list.moves[0].special == CASTLE_QS,
+        "Can't castle kingside through check"
+    );
+    // rook on e8 checks the king so neither castle is allowed
+    testboard = fen_to_board("4r1k1/8/8/8/8/8/8/R3K2R w KQ - 0 1");
+    move_list.count = 0;
+    legal_moves_castling(&move_list, testboard);
+    assert_true(
+        move_list.count == 0,
+        "Can't castle out of check"
+    );
+    // capturing the h8 rook takes away black's kingside castle
+    testboard = fen_to_board("r3k2r/8/8/8/8/8/8/R3K2R w KQkq - 0 1");
+    Move capture = {};
+    capture.src = sq_map(h1);
+    capture.dst = sq_map(h8);
+    apply_move(&testboard, capture);
+    assert_true(
+        !testboard.castle_bks && !testboard.castle_wks && testboard.castle_bqs,
+        "Castling flags cleared when rooks leave or are captured"
+    );
 }
 
 
@@ -566,12 +1448,13 @@ void test_enpassant() {
         "Correctly parsed en-passant square"
     );
     // check that move generation includes enpassant
-    Move *move_list = legal_moves_for_board(testboard);
-    Move *move_ptr = move_list;
-    while(move_ptr != NULL) {
+    MoveList move_list;
+    legal_moves_for_board(&move_list, testboard);
+    Move *move_ptr = move_list.moves;
+    while(move_ptr < move_list.moves + move_list.count) {
         if(move_ptr->special & ENPASSANT)
             break;
-        move_ptr = move_ptr->next;
+        move_ptr++;
     }
     assert_board_eq(
         move_ptr->dst,
@@ -603,7 +1486,6 @@ void test_enpassant() {
         testboard.enpassant==EMPTY_BOARD,
         "En-passant target cleared"
     );
-    move_list_delete(&move_list);
     // test that enpassant square is actually set when it should be
     Move double_push = {};
     double_push.src = sq_map(g7);
@@ -620,13 +1502,12 @@ void test_enpassant() {
 void test_pawn_promotion()
 {
     Bitboard testboard = fen_to_board("1r6/P6k/8/8/8/8/8/7K");
-    Move *move_list = NULL;
+    MoveList move_list = {};
     legal_moves_for_pawns(&move_list, testboard);
     assert_true(
-        move_list_count(move_list)==10,
-        "10 moves available"
+        move_list.count==8,
+        "8 moves available, both pawn moves must promote"
     );
-    move_list_delete(&move_list);
     char *algebra;
     Move queen_promote = {};
     queen_promote.src = sq_map(a7);
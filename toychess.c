@@ -4,10 +4,20 @@
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
-#include <float.h>
 #include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifdef SLIDER_PEXT
+#include <immintrin.h>
+#endif
 #include "toychess.h"
 
+/* x86 gets POPCNT, LZCNT and TZCNT versions of the bit counting helpers,
+ * used when CPUID says the processor has them */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH
+#endif
+
 #define UNUSED(x) (void)(x)
 
 /* const bitmasks for bitboard */
@@ -16,12 +26,249 @@ static const uint64_t FILE_H = (uint64_t)0x0101010101010101;
 static const uint64_t FILE_AB = (uint64_t)0xC0C0C0C0C0C0C0C0;
 static const uint64_t FILE_GH = (uint64_t)0x0303030303030303;
 static const uint64_t RANK_8 = (uint64_t)0x00000000000000FF;
+static const uint64_t RANK_6 = (uint64_t)0x0000000000FF0000;
+static const uint64_t RANK_3 = (uint64_t)0x0000FF0000000000;
 static const uint64_t RANK_2 = (uint64_t)0x00FF000000000000;
 static const uint64_t RANK_1 = (uint64_t)0xFF00000000000000;
 static const uint64_t LOWEST_SQUARE = (uint64_t)0x0000000000000001;
 static const uint64_t SQUARE_0 = (uint64_t)0x8000000000000000;
 static const uint64_t EMPTY_BOARD = (uint64_t)0x0000000000000000;
 static const uint64_t WHITE_SQUARES = (uint64_t)0x55AA55AA55AA55AA;
+static const uint64_t EDGES = (uint64_t)0xFF818181818181FF;
+
+/* bit counting instructions found by init_cpu_features */
+static bool CPU_HAS_POPCNT = false;
+static bool CPU_HAS_LZCNT = false;
+static bool CPU_HAS_TZCNT = false;
+
+/* sliding attack lookup tables, filled by init_tables. Every square gets
+ * a slice of SLIDER_ATTACKS with one entry per arrangement of blockers
+ * on its rays */
+static SliderMagic ROOK_MAGICS[64];
+static SliderMagic BISHOP_MAGICS[64];
+static uint64_t SLIDER_ATTACKS[ROOK_ATTACK_ENTRIES + BISHOP_ATTACK_ENTRIES];
+
+/* attacks for a single knight, king or pawn on each square, filled by
+ * init_tables. Pawn attacks are indexed by colour, white's go north */
+static uint64_t KNIGHT_ATTACKS[64];
+static uint64_t KING_ATTACKS[64];
+static uint64_t PAWN_ATTACKS[2][64];
+
+/* squares strictly between two squares on a shared rank, file or
+ * diagonal, and the whole line through them. Empty if not aligned */
+static uint64_t BETWEEN[64][64];
+static uint64_t LINE[64][64];
+
+/* random keys xor'd together to make a position's Zobrist hash, filled
+ * by init_zobrist. Pieces are indexed by their nibble, castling by the
+ * castle flags packed as castling_flags does and en-passant by file */
+static uint64_t ZOBRIST_PIECES[16][64];
+static uint64_t ZOBRIST_CASTLING[16];
+static uint64_t ZOBRIST_ENPASSANT[8];
+static uint64_t ZOBRIST_BLACK_MOVE;
+
+/* transposition table for the search, sized by tt_init. Left NULL the
+ * search runs without one */
+static TTBucket *TT = NULL;
+static uint64_t TT_MASK = 0;
+
+/* counts the searches made, bumped by search_reset, so entries left by
+ * earlier searches can be told from the current one's */
+static uint16_t TT_GENERATION = 0;
+
+/* piece values in centipawns, indexed by piece type, which the
+ * evaluation and the static exchange evaluation count material with */
+static const int PIECE_VALUES[8] = {
+    0, PAWN_VALUE, KNIGHT_VALUE, BISHOP_VALUE, ROOK_VALUE, QUEEN_VALUE, KING_VALUE, 0
+};
+
+/* piece-square tables in centipawns, laid out as white sees the board
+ * with a8 first, so white's squares look up sq ^ 56 and black's sq */
+static const int8_t PAWN_PST_MG[64] = {
+      0,   0,   0,   0,   0,   0,   0,   0,
+     50,  50,  50,  50,  50,  50,  50,  50,
+     10,  10,  20,  30,  30,  20,  10,  10,
+      5,   5,  10,  25,  25,  10,   5,   5,
+      0,   0,   0,  20,  20,   0,   0,   0,
+      5,  -5, -10,   0,   0, -10,  -5,   5,
+      5,  10,  10, -20, -20,  10,  10,   5,
+      0,   0,   0,   0,   0,   0,   0,   0
+};
+static const int8_t PAWN_PST_EG[64] = {
+      0,   0,   0,   0,   0,   0,   0,   0,
+     80,  80,  80,  80,  80,  80,  80,  80,
+     50,  50,  50,  50,  50,  50,  50,  50,
+     30,  30,  30,  30,  30,  30,  30,  30,
+     15,  15,  15,  15,  15,  15,  15,  15,
+      5,   5,   5,   5,   5,   5,   5,   5,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0
+};
+static const int8_t KNIGHT_PST[64] = {
+    -50, -40, -30, -30, -30, -30, -40, -50,
+    -40, -20,   0,   0,   0,   0, -20, -40,
+    -30,   0,  10,  15,  15,  10,   0, -30,
+    -30,   5,  15,  20,  20,  15,   5, -30,
+    -30,   0,  15,  20,  20,  15,   0, -30,
+    -30,   5,  10,  15,  15,  10,   5, -30,
+    -40, -20,   0,   5,   5,   0, -20, -40,
+    -50, -40, -30, -30, -30, -30, -40, -50
+};
+static const int8_t BISHOP_PST[64] = {
+    -20, -10, -10, -10, -10, -10, -10, -20,
+    -10,   0,   0,   0,   0,   0,   0, -10,
+    -10,   0,   5,  10,  10,   5,   0, -10,
+    -10,   5,   5,  10,  10,   5,   5, -10,
+    -10,   0,  10,  10,  10,  10,   0, -10,
+    -10,  10,  10,  10,  10,  10,  10, -10,
+    -10,   5,   0,   0,   0,   0,   5, -10,
+    -20, -10, -10, -10, -10, -10, -10, -20
+};
+static const int8_t ROOK_PST[64] = {
+      0,   0,   0,   0,   0,   0,   0,   0,
+      5,  10,  10,  10,  10,  10,  10,   5,
+     -5,   0,   0,   0,   0,   0,   0,  -5,
+     -5,   0,   0,   0,   0,   0,   0,  -5,
+     -5,   0,   0,   0,   0,   0,   0,  -5,
+     -5,   0,   0,   0,   0,   0,   0,  -5,
+     -5,   0,   0,   0,   0,   0,   0,  -5,
+      0,   0,   0,   5,   5,   0,   0,   0
+};
+static const int8_t QUEEN_PST[64] = {
+    -20, -10, -10,  -5,  -5, -10, -10, -20,
+    -10,   0,   0,   0,   0,   0,   0, -10,
+    -10,   0,   5,   5,   5,   5,   0, -10,
+     -5,   0,   5,   5,   5,   5,   0,  -5,
+      0,   0,   5,   5,   5,   5,   0,  -5,
+    -10,   5,   5,   5,   5,   5,   0, -10,
+    -10,   0,   5,   0,   0,   0,   0, -10,
+    -20, -10, -10,  -5,  -5, -10, -10, -20
+};
+static const int8_t KING_PST_MG[64] = {
+    -30, -40, -40, -50, -50, -40, -40, -30,
+    -30, -40, -40, -50, -50, -40, -40, -30,
+    -30, -40, -40, -50, -50, -40, -40, -30,
+    -30, -40, -40, -50, -50, -40, -40, -30,
+    -20, -30, -30, -40, -40, -30, -30, -20,
+    -10, -20, -20, -20, -20, -20, -20, -10,
+     20,  20,   0,   0,   0,   0,  20,  20,
+     20,  30,  10,   0,   0,  10,  30,  20
+};
+static const int8_t KING_PST_EG[64] = {
+    -50, -40, -30, -20, -20, -30, -40, -50,
+    -30, -20, -10,   0,   0, -10, -20, -30,
+    -30, -10,  20,  30,  30,  20, -10, -30,
+    -30, -10,  30,  40,  40,  30, -10, -30,
+    -30, -10,  30,  40,  40,  30, -10, -30,
+    -30, -10,  20,  30,  30,  20, -10, -30,
+    -30, -30,   0,   0,   0,   0, -30, -30,
+    -50, -30, -30, -30, -30, -30, -30, -50
+};
+static const int8_t EMPTY_PST[64] = {0};
+
+// each phase's table by piece type
+static const int8_t *const PIECE_SQUARE_TABLES[2][8] = {
+    {
+        EMPTY_PST, PAWN_PST_MG, KNIGHT_PST, BISHOP_PST,
+        ROOK_PST, QUEEN_PST, KING_PST_MG, EMPTY_PST
+    },
+    {
+        EMPTY_PST, PAWN_PST_EG, KNIGHT_PST, BISHOP_PST,
+        ROOK_PST, QUEEN_PST, KING_PST_EG, EMPTY_PST
+    }
+};
+
+/* how much each piece type adds to the game phase, the pieces at the
+ * start of a game add up to MAX_PHASE */
+static const int PHASE_WEIGHTS[8] = {0, 0, 1, 1, 2, 4, 0, 0};
+
+/* the search's per-ply state, indexed by ply with the root at 0. The
+ * quiescence search can go one ply past MAX_PLY. Its pv fields make a
+ * triangular principal variation table: each node copies its best
+ * child's line in behind its own move, so the root ends up with the
+ * whole line. Every search thread keeps its own */
+static _Thread_local SearchPly SEARCH_STACK[MAX_PLY + 1];
+
+/* how often each from/to square pair has caused a cutoff for each side,
+ * cleared by search_reset */
+static _Thread_local int HISTORY[2][64][64];
+
+/* how eval_shannon counts mobility */
+EvalOptions eval_options = {false};
+
+/* which of the selective search's prunings and reductions are used, off
+ * the search is full width down to the quiescence search */
+SearchOptions search_options = {true, true, true};
+
+/* counters for the most recent search_root, per thread until the helper
+ * threads' counts are added to the main thread's at the end */
+_Thread_local SearchStats search_stats;
+
+/* threads search_iterative uses, the main thread and search_threads - 1
+ * helpers sharing the transposition table */
+int search_threads = 1;
+
+/* when the running search started and how long it may go on, a hard
+ * limit of 0 is no limit. search_aborted is set once it's exceeded, or
+ * the main thread is done, and stops every thread */
+static struct timespec search_start;
+static long search_hard_ms = 0;
+static atomic_bool search_aborted = false;
+
+/* limits negamax_mover searches with, match_player sets them from the
+ * game clock before each move */
+SearchLimits mover_limits = {MAX_SEARCH_DEPTH, DEFAULT_SOFT_MS, DEFAULT_HARD_MS};
+
+/* magic multipliers found by the search in init_slider_square, kept here
+ * so start up doesn't have to repeat it */
+static const uint64_t ROOK_MAGIC_NUMBERS[64] = {
+    0x0004022185040042, 0x01A0221039008804, 0x024100040008A251,
+    0x3012000904102002, 0x006A004008201106, 0x092040100A002082,
+    0x0020804001002011, 0x0044B10480044021, 0x1042006100840200,
+    0x1005800200010080, 0x120A00051008E200, 0x0002080011010500,
+    0x0412811004880080, 0x0001084010200100, 0x8642400221048100,
+    0x0130400280092080, 0x80104082450A0004, 0x0002000401420088,
+    0x941A001020040400, 0x80C0080005010010, 0x608C100008008080,
+    0x0002004820820010, 0x2180500020024000, 0x0180002001D14000,
+    0x4208006902000084, 0xA020880204002110, 0x00001020080104C0,
+    0x0824008008080040, 0x8008804801801004, 0x0810801000802004,
+    0x0000401000402000, 0x00C0048024800056, 0x0001288200041041,
+    0x4001000100040200, 0x4A02008080040002, 0x0205001100040800,
+    0x1830080080100082, 0x0090040020080020, 0x0020002080400081,
+    0x0440104080002080, 0x000002000501419C, 0x8010040001021008,
+    0x0004004002010040, 0x0050050008010051, 0x2029030020197000,
+    0x0144110020004304, 0x0000848040002000, 0x0102908001400861,
+    0x2041000852008100, 0x0006000802000401, 0x0002801400020080,
+    0x0400800800040083, 0x0003002101D00048, 0x0342004080102200,
+    0x0028808040002000, 0x0900802040008000, 0x0200098200240045,
+    0xC480010002000A80, 0x0280110200040080, 0x0100041100020800,
+    0x4100082004100101, 0x0880091000802000, 0x0200110082004020,
+    0x8080008820104001,
+};
+static const uint64_t BISHOP_MAGIC_NUMBERS[64] = {
+    0x822A044808194080, 0x2048088330120200, 0x0100002084012204,
+    0x0900001010202200, 0x0000081001040900, 0x2C80804100809000,
+    0x8006002488480802, 0x0402010901100201, 0x0244010204210201,
+    0x6011049144040040, 0x8009600A42021408, 0x4010004005010040,
+    0x4120608642020800, 0x0000020510880120, 0x009080A088200010,
+    0x50808084104060C6, 0x0001080606408080, 0x00080800908A0C20,
+    0x0350025004080440, 0x0080680100428400, 0x1040804010400204,
+    0x1C02002208000100, 0x0009041044864260, 0x0602022340022002,
+    0x021C80820001090B, 0x8090430300022280, 0x2802040110880800,
+    0x8004100280140084, 0x0205020080080080, 0x8020845000010400,
+    0x0124500808020200, 0x80C2082004400241, 0x0448882002010400,
+    0x9C00849003041004, 0x0012008008080140, 0x0060840000802020,
+    0x141828000A820032, 0x2800500925010201, 0x228802802810A100,
+    0x6004062410200801, 0x0545020200420211, 0xA001000061101004,
+    0x2001000200820100, 0x8042000400942402, 0x0401022804110420,
+    0x2430201800802208, 0x58208008880B1150, 0x0040200450240D40,
+    0x0240620092015000, 0x84080A0090084885, 0x0110011008041830,
+    0x80C2908820000020, 0x0003082040400300, 0x20028467040B0000,
+    0x04B6204480808108, 0x0120200242381112, 0x170A060114120204,
+    0x0202009048080101, 0x0018C80840041003, 0x0001104000121840,
+    0x0144041480020182, 0x010800810A010800, 0x081C1004A2018440,
+    0x8008121C18020010,
+};
 
 const char  *SQUARE_NAMES[] = {
     "a1", "b1", "c1", "d1", "e1", "f1", "g1", "h1",
@@ -102,6 +349,13 @@ void upside_down_board(Bitboard *board)
     board->queens = upside_down(board->queens);
     board->whites = upside_down(board->whites);
     board->enpassant = upside_down(board->enpassant);
+    // mirror the mailbox ranks the same way, sq ^ 56 swaps rank 1 and 8
+    uint8_t swap;
+    for(int sq = 0; sq < 32; sq++) {
+        swap = board->piece[sq];
+        board->piece[sq] = board->piece[sq ^ 56];
+        board->piece[sq ^ 56] = swap;
+    }
 }
 
 
@@ -109,13 +363,60 @@ Bitboard enemy_board(Bitboard board)
 {
     upside_down_board(&board);
     board.whites = ~board.whites;
+    for(int sq = 0; sq < 64; sq++) {
+        if(board.piece[sq])
+            board.piece[sq] ^= WHITE;
+    }
+    board.hash = zobrist_key(board);
+    init_eval_totals(&board);
     return board;
 }
 
+#ifdef CPU_DISPATCH
+__attribute__((target("popcnt")))
+static int population_count_popcnt(uint64_t bitlayer)
+{
+    return __builtin_popcountll(bitlayer);
+}
+
+
+__attribute__((target("lzcnt")))
+static int bitscan_lzcnt(uint64_t b)
+{
+    return __builtin_clzll(b);
+}
+
+
+__attribute__((target("bmi")))
+static int pop_square_tzcnt(uint64_t *bitlayer)
+{
+    int sq = 63 - __builtin_ctzll(*bitlayer);
+    *bitlayer &= *bitlayer - 1;
+    return sq;
+}
+#endif
+
+
+void init_cpu_features(void)
+{
+    // pick the hardware bit counting helpers the processor supports
+#ifdef CPU_DISPATCH
+    __builtin_cpu_init();
+    CPU_HAS_POPCNT = __builtin_cpu_supports("popcnt");
+    CPU_HAS_LZCNT = __builtin_cpu_supports("abm");
+    CPU_HAS_TZCNT = __builtin_cpu_supports("bmi");
+#endif
+}
+
+
 int population_count(uint64_t bitlayer)
 {
-    // Count the set bits, this method OK for sparsely populated bitmaps
+    // Count the set bits, the fallback is OK for sparsely populated bitmaps
     int c;
+#ifdef CPU_DISPATCH
+    if(CPU_HAS_POPCNT)
+        return population_count_popcnt(bitlayer);
+#endif
     for (c = 0; bitlayer; bitlayer &= (bitlayer - 1)) {
         c ++;
     }
@@ -130,6 +431,16 @@ uint64_t occupied_squares(Bitboard board)
 }
 
 
+uint64_t side_pieces(Bitboard board, bool black)
+{
+    /* every piece belonging to one side. Moves keep whites to white's
+     * pieces, but enemy_board inverts it, setting every empty square */
+    if(black)
+        return occupied_squares(board) & ~board.whites;
+    return occupied_squares(board) & board.whites;
+}
+
+
 uint64_t pawn_moves(uint64_t pawns, uint64_t enemies, uint64_t allies)
 {
     uint64_t occupied = enemies | allies;
@@ -139,9 +450,69 @@ uint64_t pawn_moves(uint64_t pawns, uint64_t enemies, uint64_t allies)
 }
 
 
+uint64_t pawn_pushes(uint64_t pawns, uint64_t occupied, bool black)
+{
+    /* single and double pushes, north for white and south for black */
+    uint64_t moves;
+    if(black) {
+        moves = shift_s(pawns) & ~occupied;
+        return moves | (shift_s(moves & RANK_6) & ~occupied);
+    }
+    moves = shift_n(pawns) & ~occupied;
+    return moves | (shift_n(moves & RANK_3) & ~occupied);
+}
+
+
+uint64_t pawn_captures(uint64_t pawns, bool black)
+{
+    /* every square the pawns attack, occupied or not */
+    if(black)
+        return shift_se(pawns) | shift_sw(pawns);
+    return shift_ne(pawns) | shift_nw(pawns);
+}
+
+
 uint64_t rook_attacks(uint64_t rooks, uint64_t enemies, uint64_t allies)
 {
-    /* sliding attack to the north, south, east and west */
+#ifdef SLIDER_LOOP
+    return rook_attacks_loop(rooks, enemies, allies);
+#else
+    /* one table lookup per rook */
+    uint64_t occupied = enemies | allies;
+    uint64_t moves = EMPTY_BOARD;
+    while(rooks)
+        moves |= rook_attacks_sq(pop_square(&rooks), occupied);
+    return moves & ~allies;
+#endif
+}
+
+
+uint64_t bishop_attacks(uint64_t bishops, uint64_t enemies, uint64_t allies)
+{
+#ifdef SLIDER_LOOP
+    return bishop_attacks_loop(bishops, enemies, allies);
+#else
+    uint64_t occupied = enemies | allies;
+    uint64_t moves = EMPTY_BOARD;
+    while(bishops)
+        moves |= bishop_attacks_sq(pop_square(&bishops), occupied);
+    return moves & ~allies;
+#endif
+}
+
+
+uint64_t queen_attacks(uint64_t queens, uint64_t enemies, uint64_t allies)
+{
+    /* queen attacks == bishop_attacks | rook_attacks */
+    uint64_t moves = bishop_attacks(queens, enemies, allies);
+    return moves | rook_attacks(queens, enemies, allies);
+}
+
+
+uint64_t rook_attacks_loop(uint64_t rooks, uint64_t enemies, uint64_t allies)
+{
+    /* reference implementation, sliding attack to the north, south, east
+     * and west. Used to build the lookup tables and to cross check them */
     uint64_t moves = sliding_attack(shift_n, rooks, enemies, allies);
     moves |= sliding_attack(shift_e, rooks, enemies, allies);
     moves |= sliding_attack(shift_s, rooks, enemies, allies);
@@ -149,7 +520,7 @@ uint64_t rook_attacks(uint64_t rooks, uint64_t enemies, uint64_t allies)
 }
 
 
-uint64_t bishop_attacks(uint64_t bishops, uint64_t enemies, uint64_t allies)
+uint64_t bishop_attacks_loop(uint64_t bishops, uint64_t enemies, uint64_t allies)
 {
     uint64_t moves = sliding_attack(shift_ne, bishops, enemies, allies);
     moves |= sliding_attack(shift_nw, bishops, enemies, allies);
@@ -158,11 +529,240 @@ uint64_t bishop_attacks(uint64_t bishops, uint64_t enemies, uint64_t allies)
 }
 
 
-uint64_t queen_attacks(uint64_t queens, uint64_t enemies, uint64_t allies)
+static inline uint64_t slider_lookup(const SliderMagic *m, uint64_t occupied)
 {
-    /* queen attacks == bishop_attacks | rook_attacks */
-    uint64_t moves = bishop_attacks(queens, enemies, allies);
-    return moves | rook_attacks(queens, enemies, allies);
+#ifdef SLIDER_PEXT
+    return m->attacks[_pext_u64(occupied, m->mask)];
+#else
+    return m->attacks[((occupied & m->mask) * m->magic) >> m->shift];
+#endif
+}
+
+
+uint64_t rook_attacks_sq(int sq, uint64_t occupied)
+{
+    /* squares a rook on sq attacks, up to and including the first piece of
+     * either colour on each ray */
+    return slider_lookup(&ROOK_MAGICS[sq], occupied);
+}
+
+
+uint64_t bishop_attacks_sq(int sq, uint64_t occupied)
+{
+    return slider_lookup(&BISHOP_MAGICS[sq], occupied);
+}
+
+
+uint64_t queen_attacks_sq(int sq, uint64_t occupied)
+{
+    return rook_attacks_sq(sq, occupied) | bishop_attacks_sq(sq, occupied);
+}
+
+
+uint64_t xorshift64(uint64_t *state)
+{
+    // small deterministic PRNG, so every run finds the same magics
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * (uint64_t)0x2545F4914F6CDD1D;
+}
+
+
+bool magic_fits(
+    const SliderMagic *m,
+    const uint64_t *occupancy,
+    const uint64_t *reference_attacks,
+    int size)
+{
+    /* fill the table slice through the magic index, failing if two blocker
+     * sets with different attacks land on the same entry */
+    static int epoch[4096];
+    static int attempt = 0;
+    int i;
+    int idx;
+    attempt++;
+    for(i = 0; i < size; i++) {
+        idx = (occupancy[i] * m->magic) >> m->shift;
+        if(epoch[idx] != attempt) {
+            epoch[idx] = attempt;
+            m->attacks[idx] = reference_attacks[i];
+        } else if(m->attacks[idx] != reference_attacks[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+uint64_t *init_slider_square(
+    SliderMagic *m,
+    uint64_t mask,
+    uint64_t square,
+    uint64_t (*reference)(uint64_t, uint64_t, uint64_t),
+    uint64_t magic,
+    uint64_t *attacks,
+    uint64_t *seed)
+{
+    /*
+     * Fill one square's slice of the attack table and return the start of
+     * the next slice. For each subset of the blocker mask compute the
+     * attacks with the reference loop, then index them with the magic
+     * multiplier, searching for a new one if it doesn't fit. With
+     * SLIDER_PEXT the index is the subset's bits extracted by pext, so no
+     * multiplier is needed
+     */
+    static uint64_t occupancy[4096];
+    static uint64_t reference_attacks[4096];
+    int bits = population_count(mask);
+    int size = 1 << bits;
+    uint64_t occupied = EMPTY_BOARD;
+    int i;
+
+    m->mask = mask;
+    m->shift = 64 - bits;
+    m->attacks = attacks;
+    // enumerate every subset of mask with the carry-rippler trick
+    for(i = 0; i < size; i++) {
+        occupancy[i] = occupied;
+        reference_attacks[i] = reference(square, occupied, EMPTY_BOARD);
+        occupied = (occupied - mask) & mask;
+    }
+#ifdef SLIDER_PEXT
+    UNUSED(magic);
+    UNUSED(seed);
+    m->magic = 0;
+    for(i = 0; i < size; i++)
+        attacks[_pext_u64(occupancy[i], mask)] = reference_attacks[i];
+#else
+    m->magic = magic;
+    while(!magic_fits(m, occupancy, reference_attacks, size)) {
+        // sparse random candidates, weeding out multipliers which can't
+        // spread the mask over the index bits
+        do {
+            m->magic = xorshift64(seed) & xorshift64(seed) & xorshift64(seed);
+        } while(population_count((mask * m->magic) >> 56) < 6);
+    }
+#endif
+    return attacks + size;
+}
+
+
+void init_tables(void)
+{
+    /* build the lookup tables, must be called once before any moves are
+     * generated */
+    uint64_t *attacks = SLIDER_ATTACKS;
+    uint64_t seed = (uint64_t)0x9E3779B97F4A7C15;
+    uint64_t square;
+    uint64_t rank;
+    uint64_t file;
+    int sq;
+    init_cpu_features();
+    for(sq = 0; sq < 64; sq++) {
+        square = SQUARE_0 >> sq;
+        rank = RANK_1 >> (8 * (sq / 8));
+        file = FILE_A >> (sq % 8);
+        // the last square of each ray never blocks anything, so leave it out
+        attacks = init_slider_square(
+            &ROOK_MAGICS[sq],
+            rook_attacks_loop(square, EMPTY_BOARD, EMPTY_BOARD)
+                & ~(((RANK_1 | RANK_8) & ~rank) | ((FILE_A | FILE_H) & ~file)),
+            square,
+            rook_attacks_loop,
+            ROOK_MAGIC_NUMBERS[sq],
+            attacks,
+            &seed
+        );
+        KNIGHT_ATTACKS[sq] = knight_attacks(square, EMPTY_BOARD, EMPTY_BOARD);
+        KING_ATTACKS[sq] = king_attacks(square, EMPTY_BOARD, EMPTY_BOARD);
+        PAWN_ATTACKS[0][sq] = shift_ne(square) | shift_nw(square);
+        PAWN_ATTACKS[1][sq] = shift_se(square) | shift_sw(square);
+        attacks = init_slider_square(
+            &BISHOP_MAGICS[sq],
+            bishop_attacks_loop(square, EMPTY_BOARD, EMPTY_BOARD) & ~EDGES,
+            square,
+            bishop_attacks_loop,
+            BISHOP_MAGIC_NUMBERS[sq],
+            attacks,
+            &seed
+        );
+    }
+    init_line_tables();
+    init_zobrist();
+}
+
+
+void init_zobrist(void)
+{
+    // a fixed seed so keys, and anything hashed with them, are repeatable
+    uint64_t seed = (uint64_t)0x2545F4914F6CDD1D;
+    int piece;
+    int sq;
+    int i;
+    for(piece = 0; piece < 16; piece++) {
+        for(sq = 0; sq < 64; sq++)
+            ZOBRIST_PIECES[piece][sq] = xorshift64(&seed);
+    }
+    // no castling rights hash to nothing, so positions without any agree
+    ZOBRIST_CASTLING[0] = 0;
+    for(i = 1; i < 16; i++)
+        ZOBRIST_CASTLING[i] = xorshift64(&seed);
+    for(i = 0; i < 8; i++)
+        ZOBRIST_ENPASSANT[i] = xorshift64(&seed);
+    ZOBRIST_BLACK_MOVE = xorshift64(&seed);
+}
+
+
+int castling_flags(const Bitboard *board)
+{
+    // the castle flags packed wks, wqs, bks, bqs from bit 0
+    return board->castle_wks | board->castle_wqs << 1
+        | board->castle_bks << 2 | board->castle_bqs << 3;
+}
+
+
+uint64_t zobrist_key(Bitboard board)
+{
+    /* hash a position from scratch, apply_move and friends keep
+     * board.hash equal to this as they go */
+    uint64_t key = ZOBRIST_CASTLING[castling_flags(&board)];
+    for(int sq = 0; sq < 64; sq++) {
+        if(board.piece[sq])
+            key ^= ZOBRIST_PIECES[board.piece[sq]][sq];
+    }
+    if(board.enpassant)
+        key ^= ZOBRIST_ENPASSANT[bitscan(board.enpassant) % 8];
+    if(board.black_move)
+        key ^= ZOBRIST_BLACK_MOVE;
+    return key;
+}
+
+
+void init_line_tables(void)
+{
+    // needs the slider tables, so runs after they are filled
+    int from;
+    int to;
+    uint64_t src;
+    uint64_t dst;
+    for(from = 0; from < 64; from++) {
+        src = SQUARE_0 >> from;
+        for(to = 0; to < 64; to++) {
+            dst = SQUARE_0 >> to;
+            if(rook_attacks_sq(from, EMPTY_BOARD) & dst) {
+                BETWEEN[from][to] = rook_attacks_sq(from, dst) & rook_attacks_sq(to, src);
+                LINE[from][to] = (rook_attacks_sq(from, EMPTY_BOARD)
+                    & rook_attacks_sq(to, EMPTY_BOARD)) | src | dst;
+            } else if(bishop_attacks_sq(from, EMPTY_BOARD) & dst) {
+                BETWEEN[from][to] = bishop_attacks_sq(from, dst) & bishop_attacks_sq(to, src);
+                LINE[from][to] = (bishop_attacks_sq(from, EMPTY_BOARD)
+                    & bishop_attacks_sq(to, EMPTY_BOARD)) | src | dst;
+            }
+        }
+    }
 }
 
 
@@ -234,6 +834,48 @@ uint64_t sliding_attack(
 }
 
 
+uint64_t knight_attacks_sq(int sq)
+{
+    return KNIGHT_ATTACKS[sq];
+}
+
+
+uint64_t king_attacks_sq(int sq)
+{
+    return KING_ATTACKS[sq];
+}
+
+
+uint64_t pawn_attacks_sq(int sq, bool black)
+{
+    // both capture squares, whether or not anything stands there
+    return PAWN_ATTACKS[black][sq];
+}
+
+
+uint64_t moves_from_square(int piece, int sq, uint64_t enemies, uint64_t allies, bool black)
+{
+    /* per square counterpart of mover_func, the targets for a single piece
+     * standing on sq. Only pawns care which side they belong to */
+    uint64_t occupied = enemies | allies;
+    switch(piece & ~WHITE) {
+        case KNIGHT:
+            return KNIGHT_ATTACKS[sq] & ~allies;
+        case BISHOP:
+            return bishop_attacks_sq(sq, occupied) & ~allies;
+        case ROOK:
+            return rook_attacks_sq(sq, occupied) & ~allies;
+        case QUEEN:
+            return queen_attacks_sq(sq, occupied) & ~allies;
+        case KING:
+            return KING_ATTACKS[sq] & ~allies;
+        default:
+            return pawn_pushes(SQUARE_0 >> sq, occupied, black)
+                | (PAWN_ATTACKS[black][sq] & enemies);
+    }
+}
+
+
 PieceMover mover_func(int piece) {
     int uncoloured_piece = piece & ~WHITE;
     switch(uncoloured_piece) {
@@ -319,19 +961,39 @@ uint64_t delete_ls1b(uint64_t bitlayer, uint64_t *deleted_bit)
 
 int bitscan ( uint64_t b )
 {
-    // do binary search, this method with the fixed bitmasks will only work
-    // for a single bit, not as a generic leading zero count
-    int pos = 32;
-    pos += (b & (uint64_t)0xFFFFFFFF00000000) ? -16 : 16;
-    pos += (b & (uint64_t)0xFFFF0000FFFF0000) ? -8 : 8;
-    pos += (b & (uint64_t)0xFF00FF00FF00FF00) ? -4 : 4;
-    pos += (b & (uint64_t)0xF0F0F0F0F0F0F0F0) ? -2 : 2;
-    pos += (b & (uint64_t)0XCCCCCCCCCCCCCCCC) ? -1 : 1;
-    if (b & (uint64_t)0XAAAAAAAAAAAAAAAA) return pos -1;
+    /* square of the most significant bit, which is the lowest numbered
+     * square on the board. That's the leading zero count, b must not be
+     * empty. The fallback is a binary search that halves the window
+     * each step */
+    int pos = 0;
+#ifdef CPU_DISPATCH
+    if(CPU_HAS_LZCNT)
+        return bitscan_lzcnt(b);
+#endif
+    if(!(b & (uint64_t)0xFFFFFFFF00000000)) { pos += 32; b <<= 32; }
+    if(!(b & (uint64_t)0xFFFF000000000000)) { pos += 16; b <<= 16; }
+    if(!(b & (uint64_t)0xFF00000000000000)) { pos += 8; b <<= 8; }
+    if(!(b & (uint64_t)0xF000000000000000)) { pos += 4; b <<= 4; }
+    if(!(b & (uint64_t)0xC000000000000000)) { pos += 2; b <<= 2; }
+    if(!(b & (uint64_t)0x8000000000000000)) { pos += 1; }
     return pos;
 }
 
 
+int pop_square(uint64_t *bitlayer)
+{
+    /* remove the least significant bit from a non-empty board and return
+     * its square, so a loop over the pieces is just while(bitlayer) */
+    uint64_t ls1b;
+#ifdef CPU_DISPATCH
+    if(CPU_HAS_TZCNT)
+        return pop_square_tzcnt(bitlayer);
+#endif
+    *bitlayer = delete_ls1b(*bitlayer, &ls1b);
+    return bitscan(ls1b);
+}
+
+
 Bitboard fen_to_board(const char *fen)
 {
     /*
@@ -360,7 +1022,7 @@ Bitboard fen_to_board(const char *fen)
             );
             file++;
         }
-    } while(*fen++ != '\0' && !isspace(*fen));
+    } while(*++fen != '\0' && !isspace(*fen));
     // if we can carry on and find out which colour plays next
     if(!isspace(*fen))
         return board;
@@ -368,7 +1030,7 @@ Bitboard fen_to_board(const char *fen)
     do {
         if(*fen == 0x62)
             board.black_move = true;
-    } while(*fen++ != '\0' && !isspace(*fen));
+    } while(*++fen != '\0' && !isspace(*fen));
     // carry on and get castling flags
     if(!isspace(*fen))
         return board;
@@ -382,7 +1044,7 @@ Bitboard fen_to_board(const char *fen)
             board.castle_bks = true;
         if(*fen==0x71)
             board.castle_bqs = true;
-    } while(*fen++ != '\0' && !isspace(*fen));
+    } while(*++fen != '\0' && !isspace(*fen));
 
     // consume en-passant target square
     if(!isspace(*fen))
@@ -396,6 +1058,7 @@ Bitboard fen_to_board(const char *fen)
 
     // Currently we throw away the remainder of the FEN string
     // Future support can be added for castling, en-passant, game clock etc
+    board.hash = zobrist_key(board);
     return board;
 }
 
@@ -434,6 +1097,10 @@ int fen_to_piece(int fen_char)
 void add_piece_to_board(Bitboard *board, int piece, uint64_t target)
 {
     // Add a piece nibble to a board
+    int sq = bitscan(target);
+    board->piece[sq] = piece;
+    board->hash ^= ZOBRIST_PIECES[piece][sq];
+    update_eval_totals(board, piece, sq, 1);
     if(piece & WHITE) {
         board->whites |= target;
         piece = piece ^ WHITE;
@@ -463,30 +1130,44 @@ void add_piece_to_board(Bitboard *board, int piece, uint64_t target)
 }
 
 
-bool in_check(Bitboard board)
+bool in_check(Bitboard board, bool black)
 {
     /*
-     * return true if white is checking black
+     * return true if the given side's king is attacked
      */
-    uint64_t attacks = standard_attacks(board);
-    if (attacks & (board.kings & ~board.whites)) {
-        return true;
-    } else {
+    uint64_t king = board.kings & side_pieces(board, black);
+    if(!king)
         return false;
-    }
+    return (attackers_of(board, bitscan(king), occupied_squares(board))
+        & side_pieces(board, !black)) != EMPTY_BOARD;
+}
+
+
+uint64_t attackers_of(Bitboard board, int sq, uint64_t occupied)
+{
+    /* pieces of either colour attacking a square, sliders seeing through
+     * to the given occupancy. A pawn attacks sq from where an enemy pawn
+     * on sq would attack it */
+    uint64_t attackers = pawn_attacks_sq(sq, true) & board.pawns & board.whites;
+    attackers |= pawn_attacks_sq(sq, false) & board.pawns & ~board.whites;
+    attackers |= knight_attacks_sq(sq) & board.knights;
+    attackers |= king_attacks_sq(sq) & board.kings;
+    attackers |= rook_attacks_sq(sq, occupied) & (board.rooks | board.queens);
+    attackers |= bishop_attacks_sq(sq, occupied) & (board.bishops | board.queens);
+    return attackers & occupied;
 }
 
 
-uint64_t standard_attacks(Bitboard board)
+uint64_t standard_attacks(Bitboard board, bool black)
 {
     /*
-     * union of all squares white can attack
+     * union of all squares the given side can attack
      * excludes en passant and castling
      */
-    uint64_t allies = occupied_squares(board) & board.whites;
-    uint64_t enemies = occupied_squares(board) & ~board.whites;
+    uint64_t allies = side_pieces(board, black);
+    uint64_t enemies = side_pieces(board, !black);
 
-    uint64_t attacks = pawn_attacks(board.pawns & allies, enemies);
+    uint64_t attacks = pawn_captures(board.pawns & allies, black) & enemies;
     attacks |= rook_attacks(board.rooks & allies, enemies, allies);
     attacks |= queen_attacks(board.queens & allies, enemies, allies);
     attacks |= bishop_attacks(board.bishops & allies, enemies, allies);
@@ -502,103 +1183,137 @@ bool can_escape_check(Bitboard board)
      * Test whether we can escape from check, and if we can return true
      * a false return means we're mated
      */
-    // approach is suboptimal as we search all possible moves
-    bool can_escape = false;
-    Move *possible_moves = legal_moves_for_board(board);
-    if(possible_moves != NULL) {
-        can_escape = true;
-    }
-    move_list_delete(&possible_moves);
-    return can_escape;
-    
+    return has_legal_move(board);
+}
+
+
+uint64_t *piece_bitboard(Bitboard *board, int piece)
+{
+    // the bitboard which holds a given piece type, regardless of colour
+    switch(piece & ~WHITE) {
+        case PAWN:
+            return &board->pawns;
+        case KNIGHT:
+            return &board->knights;
+        case BISHOP:
+            return &board->bishops;
+        case ROOK:
+            return &board->rooks;
+        case QUEEN:
+            return &board->queens;
+        default:
+            return &board->kings;
+    }
 }
 
 
 int piece_at_square(Bitboard b, uint64_t t) {
-    int white_flag = b.whites & t ? WHITE : 0;
-    if(b.kings & t) {
-        return KING | white_flag;
-    } else if(b.queens & t) {
-        return QUEEN | white_flag;
-    } else if(b.rooks & t) {
-        return ROOK | white_flag;
-    } else if(b.bishops & t) {
-        return BISHOP | white_flag;
-    } else if(b.knights & t) {
-        return KNIGHT | white_flag;
-    } else if(b.pawns & t) {
-        return PAWN | white_flag;
-    }
-    // square is empty
-    return 0;
+    // the mailbox holds 0 for an empty square
+    return b.piece[bitscan(t)];
 }
 
 
 int remove_piece(Bitboard *b, uint64_t t) {
     // blank a square and return the piece that resides there
-    int white_flag = b->whites & t ? WHITE : 0;
-    if(b->kings & t) {
-        b->kings ^= t;
-        return KING | white_flag;
-    } else if(b->queens & t) {
-        b->queens ^= t;
-        return QUEEN | white_flag;
-    } else if(b->rooks & t) {
-        b->rooks ^= t;
-        return ROOK | white_flag;
-    } else if(b->bishops & t) {
-        b->bishops ^= t;
-        return BISHOP | white_flag;
-    } else if(b->knights & t) {
-        b->knights ^= t;
-        return KNIGHT | white_flag;
-    } else if(b->pawns & t) {
-        b->pawns ^= t;
-        return PAWN | white_flag;
-    }
-    // square is empty
-    return 0;
+    int sq = bitscan(t);
+    int piece = b->piece[sq];
+    if(!piece)
+        return 0;
+    *piece_bitboard(b, piece) &= ~t;
+    b->whites &= ~t;
+    b->piece[sq] = 0;
+    b->hash ^= ZOBRIST_PIECES[piece][sq];
+    update_eval_totals(b, piece, sq, -1);
+    return piece;
+}
+
+
+void update_eval_totals(Bitboard *board, int piece, int sq, int sign)
+{
+    // add (sign 1) or take away (-1) a piece's part in the evaluation
+    int black = !(piece & WHITE);
+    int type = piece & 7;
+    int index = black ? sq : sq ^ 56;
+    board->material[black] += sign * PIECE_VALUES[type];
+    board->pst[black][PHASE_MG] += sign * PIECE_SQUARE_TABLES[PHASE_MG][type][index];
+    board->pst[black][PHASE_EG] += sign * PIECE_SQUARE_TABLES[PHASE_EG][type][index];
+    board->phase += sign * PHASE_WEIGHTS[type];
+}
+
+
+void init_eval_totals(Bitboard *board)
+{
+    // sum the evaluation totals from scratch, from the mailbox
+    memset(board->material, 0, sizeof(board->material));
+    memset(board->pst, 0, sizeof(board->pst));
+    board->phase = 0;
+    for(int sq = 0; sq < 64; sq++) {
+        if(board->piece[sq])
+            update_eval_totals(board, board->piece[sq], sq, 1);
+    }
 }
 
 
-void legal_moves_for_piece(Move **move_list, Bitboard board, int piece)
+void legal_moves_for_piece(MoveList *move_list, Bitboard board, int piece)
 {
     // count the legal moves for a given piece on the board
     uint64_t allies = occupied_squares(board) & board.whites;
     uint64_t enemies = occupied_squares(board) & ~board.whites;
-    PieceMover piece_mover = mover_func(piece);
     // get the pieces
     uint64_t next_piece = EMPTY_BOARD;
     uint64_t remaining_pieces = squares_with_piece(board, piece) & allies;
-    while(population_count(remaining_pieces) > 0) {
+    while(remaining_pieces) {
         remaining_pieces = delete_ls1b(remaining_pieces, &next_piece);
         legal_moves(
             move_list,
             board,
             next_piece,
-            piece_mover(next_piece, enemies, allies)
+            moves_from_square(piece, bitscan(next_piece), enemies, allies, false)
         );
     }
 }
 
 
-void legal_moves_castling(Move **move_list, Bitboard board)
+bool castle_path_safe(Bitboard board, uint64_t path)
+{
+    /* the king may not castle out of, through or into check, so walk it
+     * along each square of its path and test for check */
+    uint64_t king = board.kings & board.whites;
+    uint64_t next_square;
+    Bitboard tmp_board;
+    while(path) {
+        path = delete_ls1b(path, &next_square);
+        tmp_board = board;
+        tmp_board.kings = (board.kings & ~king) | next_square;
+        tmp_board.whites = (board.whites & ~king) | next_square;
+        if(in_check(tmp_board, false))
+            return false;
+    }
+    return true;
+}
+
+
+void legal_moves_castling(MoveList *move_list, Bitboard board)
 {
     static const uint64_t ks_squares = (uint64_t)0x0600000000000000;
     static const uint64_t qs_squares = (uint64_t)0x7000000000000000;
+    static const uint64_t ks_king_path = (uint64_t)0x0E00000000000000;
+    static const uint64_t qs_king_path = (uint64_t)0x3800000000000000;
     uint64_t occupied = occupied_squares(board);
     Move castle = {}; // gets re-used, not ideal
 
     bool castle_ks = board.black_move ? board.castle_bks : board.castle_wks;
     bool castle_qs = board.black_move ? board.castle_bqs : board.castle_wqs;
 
-    if(castle_ks && population_count(~occupied & ks_squares)==2){
+    if(castle_ks && population_count(~occupied & ks_squares)==2
+        && castle_path_safe(board, ks_king_path)){
         castle.dst = (uint64_t)0x0200000000000000;
         castle.src = (uint64_t)0x0800000000000000;
         castle.special = CASTLE_KS;
         move_list_push(move_list, castle);
     }
-    if(castle_qs && population_count(~occupied & qs_squares)==3){
+    if(castle_qs && population_count(~occupied & qs_squares)==3
+        && castle_path_safe(board, qs_king_path)){
         castle.dst = (uint64_t)0x2000000000000000;
         castle.src = (uint64_t)0x0800000000000000;
         castle.special = CASTLE_QS;
@@ -609,9 +1324,25 @@ void legal_moves_castling(Move **move_list, Bitboard board)
 }
 
 
-void legal_moves_for_pawns(Move **move_list, Bitboard board)
+bool enpassant_legal(Bitboard board, Move move, bool black)
+{
+    /* en-passant removes two pieces from the capturing rank, which can
+     * uncover an attack on our king, so test the resulting position */
+    uint64_t captured = black ? shift_n(move.dst) : shift_s(move.dst);
+    board.pawns ^= move.src | move.dst | captured;
+    if(black) {
+        board.whites &= ~(move.dst | captured);
+    } else {
+        board.whites = (board.whites & ~move.src) | move.dst;
+    }
+    return !in_check(board, black);
+}
+
+
+void legal_moves_for_pawns(MoveList *move_list, Bitboard board)
 {
     // get base moves
+    int first_pawn_move = move_list->count;
     legal_moves_for_piece(move_list, board, PAWN);
     // calculate en passant capture
     if(board.enpassant) {
@@ -620,22 +1351,24 @@ void legal_moves_for_pawns(Move **move_list, Bitboard board)
         enpassant.special = ENPASSANT;
         if(shift_sw(board.enpassant) & board.pawns & board.whites) {
             enpassant.src = shift_sw(board.enpassant);
-            move_list_push(move_list, enpassant);
+            if(enpassant_legal(board, enpassant, false))
+                move_list_push(move_list, enpassant);
         }
         if(shift_se(board.enpassant) & board.pawns & board.whites) {
             enpassant.src = shift_se(board.enpassant);
-            move_list_push(move_list, enpassant);
+            if(enpassant_legal(board, enpassant, false))
+                move_list_push(move_list, enpassant);
         }
     }
-    // look for pawn promotion opportunities
-    // TODO - this is a bit inefficient
-    Move *move_ptr = *move_list;
+    // look for pawn promotion opportunities, a pawn reaching the back rank
+    // must promote so the plain move becomes the queen promotion
+    int last_pawn_move = move_list->count;
+    int i;
     Move promotion = {};
-    while(move_ptr != NULL) {
-        if(move_ptr->dst & RANK_8) {
-            promotion = *move_ptr;
-            promotion.special = PROMOTE_QUEEN;
-            move_list_push(move_list, promotion);
+    for(i = first_pawn_move; i < last_pawn_move; i++) {
+        if((move_list->moves[i].dst & RANK_8) && move_list->moves[i].special == 0) {
+            move_list->moves[i].special = PROMOTE_QUEEN;
+            promotion = move_list->moves[i];
             promotion.special = PROMOTE_ROOK;
             move_list_push(move_list, promotion);
             promotion.special = PROMOTE_KNIGHT;
@@ -643,71 +1376,410 @@ void legal_moves_for_pawns(Move **move_list, Bitboard board)
             promotion.special = PROMOTE_BISHOP;
             move_list_push(move_list, promotion);
         }
-        move_ptr = move_ptr->next;
     }
 }
 
 
-void move_list_rotate(Move *moves)
+void move_list_rotate(MoveList *move_list)
 {
     // rotate all dst and src values
-    while(moves != NULL) {
-        moves->src = upside_down(moves->src);
-        moves->dst = upside_down(moves->dst);
-        moves = moves->next;
+    int i;
+    for(i = 0; i < move_list->count; i++) {
+        move_list->moves[i].src = upside_down(move_list->moves[i].src);
+        move_list->moves[i].dst = upside_down(move_list->moves[i].dst);
+    }
+}
+
+void legal_moves_for_board(MoveList *move_list, Bitboard board) {
+    /*
+     * fill the caller's move list with the moves available for the whole
+     * board. Checks and pins are worked out once up front so only legal
+     * moves are generated, rather than testing every candidate for check.
+     * Black's moves are generated in place, without flipping the board
+     */
+    move_list->count = 0;
+    CheckInfo info = check_info(board);
+    if(info.checkers) {
+        legal_moves_evasions(move_list, board, &info);
+    } else {
+        legal_moves_by_mask(move_list, board, &info, ~EMPTY_BOARD);
+        legal_moves_castling_safe(move_list, board, &info);
+    }
+}
+
+
+void legal_captures_for_board(MoveList *move_list, Bitboard board)
+{
+    /* captures and promotions for the quiescence search. In check there
+     * may be no capture which escapes, so every evasion is generated */
+    move_list->count = 0;
+    CheckInfo info = check_info(board);
+    if(info.checkers) {
+        legal_moves_evasions(move_list, board, &info);
+    } else {
+        legal_moves_filtered(move_list, board, &info, ~EMPTY_BOARD, true);
     }
 }
 
-Move *legal_moves_for_board(Bitboard board) {
-    // count the moves available for the whole board
-    Move *move_list = NULL;
+
+void legal_moves_for_board_reference(MoveList *move_list, Bitboard board) {
+    /* the original copy-make generator, which applies every candidate and
+     * tests for check. Slow but simple, kept for cross checking perft. It
+     * works on a white relative board, so black's position is flipped */
+    move_list->count = 0;
     if(board.black_move)
         board = enemy_board(board);
-    legal_moves_for_piece(&move_list, board, KING);
-    legal_moves_for_piece(&move_list, board, QUEEN);
-    legal_moves_for_piece(&move_list, board, ROOK);
-    legal_moves_for_piece(&move_list, board, BISHOP);
-    legal_moves_for_piece(&move_list, board, KNIGHT);
-    legal_moves_for_pawns(&move_list, board);
-    legal_moves_castling(&move_list, board);
+    legal_moves_for_piece(move_list, board, KING);
+    legal_moves_for_piece(move_list, board, QUEEN);
+    legal_moves_for_piece(move_list, board, ROOK);
+    legal_moves_for_piece(move_list, board, BISHOP);
+    legal_moves_for_piece(move_list, board, KNIGHT);
+    legal_moves_for_pawns(move_list, board);
+    legal_moves_castling(move_list, board);
 
     if(board.black_move)
         move_list_rotate(move_list);
 
     // castling moves handled outside rotation
-    return move_list;
 }
 
 
-void apply_move(Bitboard *board_ref, const Move move) {
-    int target_piece = remove_piece(board_ref, move.dst);
-    int src_piece = remove_piece(board_ref, move.src);
-    if(move.special & PROMOTE) {
-        src_piece ^= PAWN;
-        if(move.special == PROMOTE_QUEEN) {
-            src_piece |= QUEEN;
-        } else if(move.special == PROMOTE_ROOK) {
-            src_piece |= ROOK;
-        } else if(move.special == PROMOTE_KNIGHT) {
-            src_piece |= KNIGHT;
-        } else if(move.special == PROMOTE_BISHOP) {
-            src_piece |= BISHOP;
+uint64_t side_attacks(Bitboard board, bool black, uint64_t occupied)
+{
+    /* every square attacked by one side, including squares holding its
+     * own pieces, with sliders seeing through to the given occupancy */
+    uint64_t pieces = side_pieces(board, black);
+    uint64_t attacks = pawn_captures(board.pawns & pieces, black);
+    attacks |= knight_attacks(board.knights & pieces, EMPTY_BOARD, EMPTY_BOARD);
+    attacks |= king_attacks(board.kings & pieces, EMPTY_BOARD, EMPTY_BOARD);
+    attacks |= rook_attacks((board.rooks | board.queens) & pieces, occupied, EMPTY_BOARD);
+    attacks |= bishop_attacks((board.bishops | board.queens) & pieces, occupied, EMPTY_BOARD);
+    return attacks;
+}
+
+
+CheckInfo check_info(Bitboard board)
+{
+    /*
+     * Find the pieces checking the side to move's king, its pieces pinned
+     * against the king and the squares the king can't step to. The king is
+     * lifted off the board for the danger squares so it can't hide behind
+     * itself from a slider
+     */
+    CheckInfo info = {};
+    bool black = board.black_move;
+    uint64_t occupied = occupied_squares(board);
+    uint64_t allies = side_pieces(board, black);
+    uint64_t enemies = side_pieces(board, !black);
+    uint64_t king = board.kings & allies;
+    uint64_t straight = (board.rooks | board.queens) & enemies;
+    uint64_t diagonal = (board.bishops | board.queens) & enemies;
+    uint64_t snipers;
+    uint64_t sniper;
+    uint64_t blockers;
+
+    info.king_sq = bitscan(king);
+    info.danger = side_attacks(board, !black, occupied ^ king);
+    info.checkers = knight_attacks_sq(info.king_sq) & board.knights & enemies;
+    info.checkers |= pawn_attacks_sq(info.king_sq, black) & board.pawns & enemies;
+    // sliders which would attack the king through our pieces alone
+    snipers = rook_attacks_sq(info.king_sq, enemies) & straight;
+    snipers |= bishop_attacks_sq(info.king_sq, enemies) & diagonal;
+    while(snipers) {
+        snipers = delete_ls1b(snipers, &sniper);
+        blockers = BETWEEN[info.king_sq][bitscan(sniper)] & occupied;
+        if(!blockers) {
+            info.checkers |= sniper;
+        } else if((blockers & (blockers - 1)) == 0 && (blockers & allies)) {
+            info.pinned |= blockers;
         }
     }
-    add_piece_to_board(board_ref, src_piece, move.dst);
-    // check for castling
-    if(move.special == CASTLE_KS) {
-        // swap the rook over
-        if(board_ref->black_move) {
-            add_piece_to_board(board_ref,
-                remove_piece(board_ref, (uint64_t)0x0000000000000001),
-                (uint64_t)0x0000000000000004
-            );
-        } else {
-            add_piece_to_board(board_ref,
-                remove_piece(board_ref, (uint64_t)0x0100000000000000),
-                (uint64_t)0x0400000000000000
-            );
+    return info;
+}
+
+
+uint64_t legal_targets(const CheckInfo *info, int piece, int sq, uint64_t enemies, uint64_t allies, bool black, uint64_t target_mask)
+{
+    /* the squares the piece on sq can legally move to within target_mask,
+     * which is every square unless we need to block or capture a checker.
+     * A pinned piece is further held to the line through it and its king.
+     * The king can go anywhere that isn't attacked, check or no check */
+    uint64_t targets;
+    if(piece == KING)
+        return king_attacks_sq(sq) & ~allies & ~info->danger;
+    targets = moves_from_square(piece, sq, enemies, allies, black) & target_mask;
+    if((SQUARE_0 >> sq) & info->pinned)
+        targets &= LINE[info->king_sq][sq];
+    return targets;
+}
+
+
+uint64_t enpassant_capturers(Bitboard board, uint64_t target_mask)
+{
+    /* the side to move's pawns which can legally capture en-passant,
+     * rare enough to test by making the capture */
+    bool black = board.black_move;
+    uint64_t captured = black ? shift_n(board.enpassant) : shift_s(board.enpassant);
+    uint64_t capturers;
+    uint64_t legal = EMPTY_BOARD;
+    Move enpassant = {};
+    if(!board.enpassant || !(target_mask & (board.enpassant | captured)))
+        return EMPTY_BOARD;
+    // our pawns stand where an enemy pawn on the target would attack
+    capturers = pawn_attacks_sq(bitscan(board.enpassant), !black);
+    capturers &= board.pawns & side_pieces(board, black);
+    enpassant.dst = board.enpassant;
+    enpassant.special = ENPASSANT;
+    while(capturers) {
+        capturers = delete_ls1b(capturers, &enpassant.src);
+        if(enpassant_legal(board, enpassant, black))
+            legal |= enpassant.src;
+    }
+    return legal;
+}
+
+
+void legal_moves_by_mask(MoveList *move_list, Bitboard board, const CheckInfo *info, uint64_t target_mask)
+{
+    legal_moves_filtered(move_list, board, info, target_mask, false);
+}
+
+
+void legal_moves_filtered(MoveList *move_list, Bitboard board, const CheckInfo *info, uint64_t target_mask, bool captures_only)
+{
+    /*
+     * Generate the side to move's legal moves whose destinations fall
+     * within target_mask, as found by legal_targets. With captures_only
+     * set quiet moves are left out, apart from pawn pushes which promote
+     */
+    static const int piece_order[] = {QUEEN, ROOK, BISHOP, KNIGHT, PAWN};
+    bool black = board.black_move;
+    uint64_t allies = side_pieces(board, black);
+    uint64_t enemies = side_pieces(board, !black);
+    uint64_t promotion_rank = black ? RANK_1 : RANK_8;
+    uint64_t remaining_pieces;
+    uint64_t next_piece;
+    uint64_t targets;
+    uint64_t next_target;
+    Move next_move = {};
+    int piece;
+    int sq;
+    int i;
+
+    targets = legal_targets(info, KING, info->king_sq, enemies, allies, black, target_mask);
+    if(captures_only)
+        targets &= enemies;
+    next_move.src = SQUARE_0 >> info->king_sq;
+    while(targets) {
+        targets = delete_ls1b(targets, &next_move.dst);
+        move_list_push(move_list, next_move);
+    }
+    for(i = 0; i < 5; i++) {
+        piece = piece_order[i];
+        remaining_pieces = squares_with_piece(board, piece) & allies;
+        while(remaining_pieces) {
+            sq = pop_square(&remaining_pieces);
+            next_piece = SQUARE_0 >> sq;
+            targets = legal_targets(info, piece, sq, enemies, allies, black, target_mask);
+            if(captures_only)
+                targets &= piece == PAWN ? enemies | promotion_rank : enemies;
+            next_move.src = next_piece;
+            while(targets) {
+                targets = delete_ls1b(targets, &next_target);
+                next_move.dst = next_target;
+                if(piece == PAWN && (next_target & promotion_rank)) {
+                    next_move.special = PROMOTE_QUEEN;
+                    move_list_push(move_list, next_move);
+                    next_move.special = PROMOTE_ROOK;
+                    move_list_push(move_list, next_move);
+                    next_move.special = PROMOTE_KNIGHT;
+                    move_list_push(move_list, next_move);
+                    next_move.special = PROMOTE_BISHOP;
+                    move_list_push(move_list, next_move);
+                    next_move.special = 0;
+                } else {
+                    move_list_push(move_list, next_move);
+                }
+            }
+        }
+    }
+    targets = enpassant_capturers(board, target_mask);
+    next_move.dst = board.enpassant;
+    next_move.special = ENPASSANT;
+    while(targets) {
+        targets = delete_ls1b(targets, &next_move.src);
+        move_list_push(move_list, next_move);
+    }
+}
+
+
+uint64_t evasion_mask(const CheckInfo *info)
+{
+    /* we're in check: with two checkers only the king can move, otherwise
+     * capture the checker or block its line to the king */
+    if(info->checkers & (info->checkers - 1))
+        return EMPTY_BOARD;
+    return info->checkers | BETWEEN[info->king_sq][bitscan(info->checkers)];
+}
+
+
+void legal_moves_evasions(MoveList *move_list, Bitboard board, const CheckInfo *info)
+{
+    legal_moves_by_mask(move_list, board, info, evasion_mask(info));
+}
+
+
+int castling_available(Bitboard board, const CheckInfo *info)
+{
+    /* CASTLE_KS and/or CASTLE_QS if the side to move can castle that way
+     * now, using the danger squares from check_info. Only valid when we're
+     * not in check. Masks are for white, black's are on the top rank so
+     * shift them down */
+    static const uint64_t ks_squares = (uint64_t)0x0600000000000000;
+    static const uint64_t qs_squares = (uint64_t)0x7000000000000000;
+    static const uint64_t qs_king_path = (uint64_t)0x3000000000000000;
+    int rank_shift = board.black_move ? 56 : 0;
+    uint64_t occupied = occupied_squares(board);
+    int available = 0;
+
+    bool castle_ks = board.black_move ? board.castle_bks : board.castle_wks;
+    bool castle_qs = board.black_move ? board.castle_bqs : board.castle_wqs;
+
+    if(castle_ks && !((occupied | info->danger) & (ks_squares >> rank_shift)))
+        available |= CASTLE_KS;
+    if(castle_qs && !(occupied & (qs_squares >> rank_shift))
+        && !(info->danger & (qs_king_path >> rank_shift)))
+        available |= CASTLE_QS;
+    return available;
+}
+
+
+void legal_moves_castling_safe(MoveList *move_list, Bitboard board, const CheckInfo *info)
+{
+    // add the castling moves found by castling_available
+    int rank_shift = board.black_move ? 56 : 0;
+    int available = castling_available(board, info);
+    Move castle = {};
+    castle.src = (uint64_t)0x0800000000000000 >> rank_shift;
+
+    if(available & CASTLE_KS) {
+        castle.dst = (uint64_t)0x0200000000000000 >> rank_shift;
+        castle.special = CASTLE_KS;
+        move_list_push(move_list, castle);
+    }
+    if(available & CASTLE_QS) {
+        castle.dst = (uint64_t)0x2000000000000000 >> rank_shift;
+        castle.special = CASTLE_QS;
+        move_list_push(move_list, castle);
+    }
+}
+
+
+int legal_move_count_by_mask(Bitboard board, const CheckInfo *info, uint64_t target_mask, bool any)
+{
+    /*
+     * Count the moves legal_moves_by_mask would generate by counting the
+     * target squares, without building any moves. With any set return as
+     * soon as one is found, the king goes first as it's the likeliest
+     * to have a move when the count is low
+     */
+    static const int piece_order[] = {QUEEN, ROOK, BISHOP, KNIGHT, PAWN};
+    bool black = board.black_move;
+    uint64_t allies = side_pieces(board, black);
+    uint64_t enemies = side_pieces(board, !black);
+    uint64_t promotion_rank = black ? RANK_1 : RANK_8;
+    uint64_t remaining_pieces;
+    uint64_t targets;
+    int count;
+    int piece;
+    int sq;
+    int i;
+
+    targets = legal_targets(info, KING, info->king_sq, enemies, allies, black, target_mask);
+    count = population_count(targets);
+    if(any && count)
+        return count;
+    for(i = 0; i < 5; i++) {
+        piece = piece_order[i];
+        remaining_pieces = squares_with_piece(board, piece) & allies;
+        while(remaining_pieces) {
+            sq = pop_square(&remaining_pieces);
+            targets = legal_targets(info, piece, sq, enemies, allies, black, target_mask);
+            count += population_count(targets);
+            // each promotion is four moves
+            if(piece == PAWN)
+                count += 3 * population_count(targets & promotion_rank);
+            if(any && count)
+                return count;
+        }
+    }
+    return count + population_count(enpassant_capturers(board, target_mask));
+}
+
+
+int count_legal_moves(Bitboard board)
+{
+    // the number of legal moves for the side to move, no list is built
+    CheckInfo info = check_info(board);
+    if(info.checkers)
+        return legal_move_count_by_mask(board, &info, evasion_mask(&info), false);
+    return legal_move_count_by_mask(board, &info, ~EMPTY_BOARD, false)
+        + population_count(castling_available(board, &info));
+}
+
+
+bool has_legal_move(Bitboard board)
+{
+    /* true unless the side to move is mated or stalemated. Castling needn't
+     * be tested, when it's legal so is the king's step towards the rook */
+    CheckInfo info = check_info(board);
+    uint64_t target_mask = info.checkers ? evasion_mask(&info) : ~EMPTY_BOARD;
+    return legal_move_count_by_mask(board, &info, target_mask, true) > 0;
+}
+
+
+int promotion_piece(Move move)
+{
+    // the piece type a pawn promotes to, or 0 if the move isn't a promotion
+    switch(move.special) {
+        case PROMOTE_QUEEN:
+            return QUEEN;
+        case PROMOTE_ROOK:
+            return ROOK;
+        case PROMOTE_KNIGHT:
+            return KNIGHT;
+        case PROMOTE_BISHOP:
+            return BISHOP;
+    }
+    return 0;
+}
+
+
+void apply_move(Bitboard *board_ref, const Move move) {
+    // the pieces update the hash as they move, take out the rest for now
+    board_ref->hash ^= ZOBRIST_CASTLING[castling_flags(board_ref)];
+    if(board_ref->enpassant)
+        board_ref->hash ^= ZOBRIST_ENPASSANT[bitscan(board_ref->enpassant) % 8];
+    int target_piece = remove_piece(board_ref, move.dst);
+    int src_piece = remove_piece(board_ref, move.src);
+    if(move.special & PROMOTE) {
+        src_piece ^= PAWN;
+        src_piece |= promotion_piece(move);
+    }
+    add_piece_to_board(board_ref, src_piece, move.dst);
+    // check for castling
+    if(move.special == CASTLE_KS) {
+        // swap the rook over
+        if(board_ref->black_move) {
+            add_piece_to_board(board_ref,
+                remove_piece(board_ref, (uint64_t)0x0000000000000001),
+                (uint64_t)0x0000000000000004
+            );
+        } else {
+            add_piece_to_board(board_ref,
+                remove_piece(board_ref, (uint64_t)0x0100000000000000),
+                (uint64_t)0x0400000000000000
+            );
         }
     } else if(move.special == CASTLE_QS) {
         if(board_ref->black_move) {
@@ -723,7 +1795,11 @@ void apply_move(Bitboard *board_ref, const Move move) {
         }
     } else if(move.special == ENPASSANT) {
         // en-passant capture so remove trailing piece if there is one
-        remove_piece(board_ref, shift_s(move.dst));
+        if(board_ref->black_move) {
+            remove_piece(board_ref, shift_n(move.dst));
+        } else {
+            remove_piece(board_ref, shift_s(move.dst));
+        }
     }
     // clear castling flags if relevant pieces moved
     if((src_piece & 7) == KING) {
@@ -734,25 +1810,20 @@ void apply_move(Bitboard *board_ref, const Move move) {
             board_ref->castle_wks = false;
             board_ref->castle_wqs = false;
         }
-    } else if ((src_piece & 7) == ROOK) {
-        if(board_ref->black_move) {
-            if(move.src==(uint64_t)0x0000000000000008) {
-                board_ref->castle_bks = false;
-            } else {
-                board_ref->castle_bqs = false;
-            }
-        } else {
-            if(move.src==(uint64_t)0x1000000000000000) {
-                board_ref->castle_wqs = false;
-            } else {
-                board_ref->castle_wks = false;
-            }
-        }
     }
+    // moving from or capturing on a rook's home square loses that castle
+    if((move.src | move.dst) & (SQUARE_0 >> a1))
+        board_ref->castle_wqs = false;
+    if((move.src | move.dst) & (SQUARE_0 >> h1))
+        board_ref->castle_wks = false;
+    if((move.src | move.dst) & (SQUARE_0 >> a8))
+        board_ref->castle_bqs = false;
+    if((move.src | move.dst) & (SQUARE_0 >> h8))
+        board_ref->castle_bks = false;
     // clear en-passant target - this is cleared after any move
     board_ref->enpassant = EMPTY_BOARD;
     // check if move should set en_passant
-    if(src_piece & PAWN) {
+    if((src_piece & 7) == PAWN) {
         int offset = bitscan(move.dst) - bitscan(move.src);
         if(offset == 16) {
             board_ref->enpassant = shift_s(move.dst);
@@ -763,67 +1834,150 @@ void apply_move(Bitboard *board_ref, const Move move) {
     // update move clocks
     if(board_ref->black_move)
         board_ref->fullmove_clock ++;
-    if(target_piece || src_piece & PAWN) {
+    if(target_piece || (src_piece & 7) == PAWN) {
         board_ref->halfmove_clock = 0;
     } else {
         board_ref->halfmove_clock ++;
     }
     board_ref->black_move = !(board_ref->black_move);
+    board_ref->hash ^= ZOBRIST_BLACK_MOVE;
+    board_ref->hash ^= ZOBRIST_CASTLING[castling_flags(board_ref)];
+    if(board_ref->enpassant)
+        board_ref->hash ^= ZOBRIST_ENPASSANT[bitscan(board_ref->enpassant) % 8];
+#ifdef DEBUG_HASH
+    if(board_ref->hash != zobrist_key(*board_ref)) {
+        fprintf(stderr, "incremental hash %016lx differs from %016lx after %s%s\n",
+            board_ref->hash, zobrist_key(*board_ref),
+            SQUARE_NAMES[bitscan(move.src)], SQUARE_NAMES[bitscan(move.dst)]);
+        abort();
+    }
+#endif
 }
 
 
-void move_list_push(Move **move_list, Move move)
+void make_move(Bitboard *board, const Move move, Undo *undo)
 {
-    Move *new_move = malloc(sizeof(Move));
-    memcpy(new_move, &move, sizeof(Move));
-    // insert into head of list
-    new_move->next = *move_list;
-    *move_list = new_move;
+    /* apply_move, recording what unmake_move needs to take it back */
+    undo->captured = piece_at_square(*board, move.dst);
+    undo->castling = castling_flags(board);
+    undo->hash = board->hash;
+    undo->enpassant = board->enpassant;
+    undo->halfmove_clock = board->halfmove_clock;
+    apply_move(board, move);
 }
 
 
-int move_list_count(Move *move_list) {
-    int i=0;
-    Move *next_move = move_list;
-    while(next_move != NULL) {
-        i++;
-        next_move = next_move->next;
+void unmake_move(Bitboard *board, const Move move, const Undo *undo)
+{
+    /* restore the board to how it was before make_move */
+    board->black_move = !(board->black_move);
+    bool black = board->black_move;
+    int piece = remove_piece(board, move.dst);
+    if(move.special & PROMOTE)
+        piece = PAWN | (piece & WHITE);
+    add_piece_to_board(board, piece, move.src);
+    if(undo->captured)
+        add_piece_to_board(board, undo->captured, move.dst);
+    // castling rook squares are for white, black's are on the top rank
+    int rank_shift = black ? 56 : 0;
+    if(move.special == CASTLE_KS) {
+        add_piece_to_board(board,
+            remove_piece(board, (uint64_t)0x0400000000000000 >> rank_shift),
+            (uint64_t)0x0100000000000000 >> rank_shift
+        );
+    } else if(move.special == CASTLE_QS) {
+        add_piece_to_board(board,
+            remove_piece(board, (uint64_t)0x1000000000000000 >> rank_shift),
+            (uint64_t)0x8000000000000000 >> rank_shift
+        );
+    } else if(move.special == ENPASSANT) {
+        if(black) {
+            add_piece_to_board(board, WHITE | PAWN, shift_n(move.dst));
+        } else {
+            add_piece_to_board(board, PAWN, shift_s(move.dst));
+        }
     }
-    return i;
+    board->castle_wks = undo->castling & 1;
+    board->castle_wqs = (undo->castling >> 1) & 1;
+    board->castle_bks = (undo->castling >> 2) & 1;
+    board->castle_bqs = (undo->castling >> 3) & 1;
+    board->enpassant = undo->enpassant;
+    board->halfmove_clock = undo->halfmove_clock;
+    // moving the pieces back has changed the hash, but we have a copy
+    board->hash = undo->hash;
+    if(black)
+        board->fullmove_clock --;
 }
 
 
-int move_list_delete(Move **move_list) {
-    Move *popped;
-    int i = 0;
-    while(*move_list != NULL) {
-        popped = *move_list;
-        *move_list = popped->next;
-        free(popped);
-        i++;
-    }
-    return i;
+void make_null_move(Bitboard *board, Undo *undo)
+{
+    /* pass the move to the other side, for null move pruning. Nothing
+     * can be captured en-passant after a pass */
+    undo->hash = board->hash;
+    undo->enpassant = board->enpassant;
+    undo->halfmove_clock = board->halfmove_clock;
+    if(board->enpassant)
+        board->hash ^= ZOBRIST_ENPASSANT[bitscan(board->enpassant) % 8];
+    board->enpassant = EMPTY_BOARD;
+    board->halfmove_clock ++;
+    board->black_move = !(board->black_move);
+    board->hash ^= ZOBRIST_BLACK_MOVE;
+}
+
+
+void unmake_null_move(Bitboard *board, const Undo *undo)
+{
+    board->black_move = !(board->black_move);
+    board->enpassant = undo->enpassant;
+    board->halfmove_clock = undo->halfmove_clock;
+    board->hash = undo->hash;
 }
 
 
-void legal_moves(Move **move_list, Bitboard board, uint64_t origin, uint64_t targets)
+void move_list_push(MoveList *move_list, Move move)
+{
+    // append to the caller's buffer, no allocation needed
+    move_list->moves[move_list->count++] = move;
+}
+
+
+PackedMove pack_move(Move move)
+{
+    /* specials are single bits, so the flag nibble is the bit's index + 1
+     * leaving 0 for a plain move */
+    PackedMove flag = move.special ? population_count(move.special - 1) + 1 : 0;
+    return bitscan(move.src) | bitscan(move.dst) << 6 | flag << 12;
+}
+
+
+Move unpack_move(PackedMove packed)
+{
+    Move move = {};
+    int flag = packed >> 12;
+    move.src = SQUARE_0 >> (packed & 63);
+    move.dst = SQUARE_0 >> ((packed >> 6) & 63);
+    move.special = flag ? 1 << (flag - 1) : 0;
+    return move;
+}
+
+
+void legal_moves(MoveList *move_list, Bitboard board, uint64_t origin, uint64_t targets)
 {
     uint64_t next_target;
-    uint64_t remaining_targets;
-    if(!targets)
-        return; // nothing to do here
-    remaining_targets = delete_ls1b(targets, &next_target);
-    if(remaining_targets) {
-        legal_moves(move_list, board, origin, remaining_targets);
-    }
-    // determine if we're capturing a piece clear it first
+    Bitboard tmp_board;
     Move next_move = {};
     next_move.src = origin;
-    next_move.dst = next_target;
-    apply_move(&board, next_move);
-    // assess whether the board is now in check
-    if(!in_check(enemy_board(board))) {
-        move_list_push(move_list, next_move);
+    while(targets) {
+        targets = delete_ls1b(targets, &next_target);
+        // determine if we're capturing a piece clear it first
+        next_move.dst = next_target;
+        tmp_board = board;
+        apply_move(&tmp_board, next_move);
+        // assess whether the board is now in check
+        if(!in_check(tmp_board, false)) {
+            move_list_push(move_list, next_move);
+        }
     }
 }
 
@@ -853,30 +2007,20 @@ uint64_t squares_with_piece(Bitboard board, int piece)
 uint64_t src_pieces(Bitboard board, uint64_t target, int piece)
 {
     // return the locations of the pieces which can reach a particular square
-    if(board.black_move) {
-        // reverse the board and adjust the target
-        board = enemy_board(board);
-        target = upside_down(target);
-    }
-    uint64_t allies = occupied_squares(board) & board.whites;
-    uint64_t enemies = occupied_squares(board) & ~board.whites;
+    uint64_t allies = side_pieces(board, board.black_move);
+    uint64_t enemies = side_pieces(board, !board.black_move);
     uint64_t remaining_pieces;
     uint64_t next_piece = EMPTY_BOARD;
     uint64_t srcs = EMPTY_BOARD;
-    // find a function which will calculate moves for this piece
-    PieceMover piece_mover = mover_func(piece);
     // get the pieces
     remaining_pieces = squares_with_piece(board, piece) & allies;
     // execute the moves for each occurence of the piece
-    while(population_count(remaining_pieces) > 0) {
+    while(remaining_pieces) {
         remaining_pieces = delete_ls1b(remaining_pieces, &next_piece);
-        if(piece_mover(next_piece, enemies, allies) & target) {
+        if(moves_from_square(piece, bitscan(next_piece), enemies, allies, board.black_move) & target) {
             srcs |= next_piece;
         }
     }
-    if(board.black_move) {
-        return upside_down(srcs);
-    }
     return srcs;
 }
 
@@ -973,62 +2117,95 @@ Move parse_algebra(Bitboard board, const char *algebra)
      */
     Move result = {};
     char *algebra_scan;
-    Move *legal_move = legal_moves_for_board(board);
-    while(legal_move != NULL) {
-        algebra_scan = algebra_for_move(board, *legal_move);
+    MoveList move_list;
+    int i;
+    legal_moves_for_board(&move_list, board);
+    for(i = 0; i < move_list.count; i++) {
+        algebra_scan = algebra_for_move(board, move_list.moves[i]);
         if(strcmp(algebra, algebra_scan) == 0) {
-            result.dst = legal_move->dst;
-            result.src = legal_move->src;
-            result.special = legal_move->special;
+            result = move_list.moves[i];
             free(algebra_scan);
             return result;
         }
         free(algebra_scan);
-        legal_move = legal_move->next;
     }
     return result;
 }
 
 
-#define pop_count_eval(pcs, whites, weight) \
-    (population_count(pcs & whites) - \
-        population_count(pcs & ~whites) \
-    ) * weight
+int attack_mobility(Bitboard board, bool black)
+{
+    /* squares each of a side's knights, bishops, rooks and queens attack
+     * which aren't its own or covered by an enemy pawn, a cheap stand in
+     * for its legal moves from the attack tables */
+    uint64_t occupied = occupied_squares(board);
+    uint64_t own = side_pieces(board, black);
+    uint64_t enemy_pawns = board.pawns & side_pieces(board, !black);
+    uint64_t safe = ~own;
+    uint64_t pieces;
+    int count = 0;
+    if(black)
+        safe &= ~(shift_ne(enemy_pawns) | shift_nw(enemy_pawns));
+    else
+        safe &= ~(shift_se(enemy_pawns) | shift_sw(enemy_pawns));
+    pieces = board.knights & own;
+    while(pieces)
+        count += population_count(knight_attacks_sq(pop_square(&pieces)) & safe);
+    pieces = (board.bishops | board.queens) & own;
+    while(pieces)
+        count += population_count(bishop_attacks_sq(pop_square(&pieces), occupied) & safe);
+    pieces = (board.rooks | board.queens) & own;
+    while(pieces)
+        count += population_count(rook_attacks_sq(pop_square(&pieces), occupied) & safe);
+    return count;
+}
 
 
-float eval_shannon(Bitboard board)
+int eval_shannon(Bitboard board)
 {
-    float score = 0.0;
-    score += pop_count_eval(board.kings, board.whites, 200);
-    score += pop_count_eval(board.queens, board.whites, 8);
-    score += pop_count_eval(board.rooks, board.whites, 5);
-    score += pop_count_eval(board.bishops, board.whites, 3);
-    score += pop_count_eval(board.knights, board.whites, 3);
-    score += pop_count_eval(board.pawns, board.whites, 1);
+    /* score in centipawns, white's advantage. Material and the piece
+     * square tables come from the board's running totals, the tables
+     * blended from middle to end game as the pieces come off */
+    int phase = board.phase < MAX_PHASE ? board.phase : MAX_PHASE;
+    int score = board.material[0] - board.material[1];
+    score += (
+        (board.pst[0][PHASE_MG] - board.pst[1][PHASE_MG]) * phase
+        + (board.pst[0][PHASE_EG] - board.pst[1][PHASE_EG]) * (MAX_PHASE - phase)
+    ) / MAX_PHASE;
     // count available moves
-    // TODO move list probably generated again so could be optimised
-    Move *my_moves = legal_moves_for_board(board);
-    Move *enemy_moves = legal_moves_for_board(enemy_board(board));
-    score += 0.1 * (
-        move_list_delete(&my_moves) - move_list_delete(&enemy_moves)
-    );
+    int white_moves;
+    int black_moves;
+    if(eval_options.legal_mobility) {
+        int moves = count_legal_moves(board);
+        int other_moves;
+        // the side not to move has no en-passant capture to make
+        board.black_move = !board.black_move;
+        board.enpassant = 0;
+        other_moves = count_legal_moves(board);
+        white_moves = board.black_move ? moves : other_moves;
+        black_moves = board.black_move ? other_moves : moves;
+    } else {
+        white_moves = attack_mobility(board, false);
+        black_moves = attack_mobility(board, true);
+    }
+    score += MOBILITY_VALUE * (white_moves - black_moves);
     // calcuate blocked_pawns
     uint64_t occupied = occupied_squares(board);
-    score -= 0.5 * (population_count(
+    score -= BLOCKED_PAWN_VALUE * (population_count(
         shift_s(occupied_squares(board) & board.pawns & board.whites)
     ) - population_count(
         shift_n(occupied_squares(board) & board.pawns & ~board.whites)
     ));
     // calculate "isolated" pawns
     // calulate "doubled" pawns
-    score -= 0.5 * (population_count(doubled_pawns(board.pawns & board.whites))
+    score -= DOUBLED_PAWN_VALUE * (population_count(doubled_pawns(board.pawns & board.whites))
     - population_count(doubled_pawns(board.pawns & ~board.whites)));
     return score;
 }
 
 uint64_t doubled_pawns(uint64_t pawns) {
     uint64_t col_pawns;
-    uint64_t doubled_pawns;
+    uint64_t doubled_pawns = EMPTY_BOARD;
     uint64_t pf;
     for(pf = FILE_A; pf; pf >>=1){
         col_pawns = pf & pawns;
@@ -1038,80 +2215,952 @@ uint64_t doubled_pawns(uint64_t pawns) {
     return doubled_pawns;
 }
 
-float negamax(Bitboard board, int depth)
+int negamax(Bitboard *board, int depth, int ply)
 {
-    // return the best move
-    if(depth==0) {
-        int who_moved = board.black_move ? -1 : 1;
-        return eval_shannon(board) * who_moved;
-    }
-    Move *legal_move = legal_moves_for_board(board);
-    Bitboard tmp_board = {};
-    float max = -FLT_MAX;
-    float score = 0.0;
-    while(legal_move != NULL) {
-        tmp_board = board;
-        apply_move(&tmp_board, *legal_move);
-        score = -negamax(tmp_board, depth - 1);
+    /* return the best score, searching in place with make/unmake. The
+     * leaves are searched by quiescence with the full window. ply, from
+     * the root, dates mates */
+    if(depth==0)
+        return quiescence(board, ply, -INFINITE_SCORE, INFINITE_SCORE);
+    MoveList move_list;
+    Undo undo;
+    int max = -INFINITE_SCORE;
+    int score = 0;
+    int i;
+    legal_moves_for_board(&move_list, *board);
+    if(!move_list.count)
+        return in_check(*board, board->black_move) ? -MATE_SCORE + ply : 0;
+    for(i = 0; i < move_list.count; i++) {
+        make_move(board, move_list.moves[i], &undo);
+        score = -negamax(board, depth - 1, ply + 1);
+        unmake_move(board, move_list.moves[i], &undo);
         if(score > max)
             max = score;
-        legal_move = legal_move->next;
     }
-    move_list_delete(&legal_move);
     return max;
 }
 
 
-Move random_mover(Bitboard board)
+void tt_init(size_t megabytes)
 {
-    // return a random move from those available
-    Move result = {};
-    Move *move_list = legal_moves_for_board(board);
-    srand(time(NULL));
-    int pos = rand() % move_list_count(move_list);
+    /* (re)allocate the transposition table, rounded down to a power of two
+     * buckets so the key can be masked. 0 turns the table off */
+    size_t buckets = 1;
+    free(TT);
+    TT = NULL;
+    TT_MASK = 0;
+    if(!megabytes)
+        return;
+    while(buckets * 2 * sizeof(TTBucket) <= megabytes * 1024 * 1024)
+        buckets *= 2;
+    // each bucket fills one cache line, so a probe costs a single miss
+    TT = aligned_alloc(sizeof(TTBucket), buckets * sizeof(TTBucket));
+    if(TT == NULL) {
+        fprintf(stderr, "unable to allocate %zuMB transposition table\n", megabytes);
+        exit(1);
+    }
+    TT_MASK = buckets - 1;
+    tt_clear();
+}
+
+
+void tt_clear(void)
+{
+    if(TT != NULL)
+        memset(TT, 0, (TT_MASK + 1) * sizeof(TTBucket));
+}
+
+
+uint64_t tt_pack_entry(TTEntry entry)
+{
+    // score in the low 16 bits, then the move, depth, bound and generation
+    return (uint16_t)entry.score | (uint64_t)entry.best_move << 16
+        | (uint64_t)(uint8_t)entry.depth << 32 | (uint64_t)entry.bound << 40
+        | (uint64_t)entry.generation << 48;
+}
+
+
+TTEntry tt_unpack_entry(uint64_t data)
+{
+    TTEntry entry;
+    entry.score = (int16_t)data;
+    entry.best_move = data >> 16;
+    entry.depth = data >> 32;
+    entry.bound = data >> 40;
+    entry.generation = data >> 48;
+    return entry;
+}
+
+
+bool tt_probe(uint64_t hash, TTEntry *entry)
+{
+    /* look for the position in its bucket, the low bits of the hash choose
+     * the bucket. Other threads may be writing, so read each slot once
+     * and only trust it if check still matches */
+    if(TT == NULL)
+        return false;
+    TTBucket *bucket = &TT[hash & TT_MASK];
+    uint64_t data;
+    search_stats.tt_probes++;
+    for(int i = 0; i < TT_BUCKET_ENTRIES; i++) {
+        data = bucket->slots[i].data;
+        if((bucket->slots[i].check ^ data) == hash && data) {
+            *entry = tt_unpack_entry(data);
+            search_stats.tt_hits++;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+int tt_replace_worth(uint64_t data)
+{
+    /* how much an entry is worth keeping, by the work it saved. Entries
+     * from earlier searches are worth less than any from this one, their
+     * positions may no longer be reachable in the game */
+    TTEntry entry = tt_unpack_entry(data);
+    if(entry.generation != TT_GENERATION)
+        return entry.depth - 256;
+    return entry.depth;
+}
+
+
+void tt_store(uint64_t hash, int depth, int bound, int score, Move best_move)
+{
+    /* write over the position's old entry if it has one, otherwise the
+     * entry in the bucket least worth keeping */
+    if(TT == NULL)
+        return;
+    TTBucket *bucket = &TT[hash & TT_MASK];
+    TTSlot *replace = &bucket->slots[0];
+    TTEntry entry = {score, NO_MOVE, depth, bound, TT_GENERATION};
+    uint64_t data;
+    if(best_move.dst)
+        entry.best_move = pack_move(best_move);
+    for(int i = 0; i < TT_BUCKET_ENTRIES; i++) {
+        data = bucket->slots[i].data;
+        if((bucket->slots[i].check ^ data) == hash) {
+            replace = &bucket->slots[i];
+            break;
+        }
+        if(tt_replace_worth(data) < tt_replace_worth(replace->data))
+            replace = &bucket->slots[i];
+    }
+    data = tt_pack_entry(entry);
+    replace->check = hash ^ data;
+    replace->data = data;
+}
+
+
+void move_to_front(MoveList *move_list, PackedMove move)
+{
+    // search the hash move first, it's the best we found last time
+    Move swap;
+    if(move == NO_MOVE)
+        return;
+    for(int i = 0; i < move_list->count; i++) {
+        if(pack_move(move_list->moves[i]) == move) {
+            swap = move_list->moves[0];
+            move_list->moves[0] = move_list->moves[i];
+            move_list->moves[i] = swap;
+            return;
+        }
+    }
+}
+
+
+int see(const Bitboard *board, Move move)
+{
+    /*
+     * Static exchange evaluation: the material the side to move comes out
+     * with, in centipawns, if both sides keep capturing on the move's
+     * destination with their least valuable piece, each stopping as soon
+     * as going on would lose. Removing a capturer from the occupancy lets
+     * a slider behind it join in (an x-ray). Pins are ignored
+     */
+    int gain[32];
+    int depth = 0;
+    int sq = bitscan(move.dst);
+    int on_square = board->piece[bitscan(move.src)] & 7;
+    bool black = board->black_move;
+    uint64_t occupied = occupied_squares(*board);
+    uint64_t diagonal = board->bishops | board->queens;
+    uint64_t straight = board->rooks | board->queens;
+    uint64_t pieces[7] = {
+        EMPTY_BOARD, board->pawns, board->knights, board->bishops,
+        board->rooks, board->queens, board->kings
+    };
+    uint64_t from = move.src;
+    uint64_t attackers;
+    uint64_t side;
+    int type;
+    gain[0] = PIECE_VALUES[board->piece[sq] & 7];
+    if(move.special == ENPASSANT) {
+        gain[0] = PIECE_VALUES[PAWN];
+        occupied ^= SQUARE_0 >> (black ? sq + 8 : sq - 8);
+    } else if(move.special & PROMOTE) {
+        on_square = promotion_piece(move);
+        gain[0] += PIECE_VALUES[on_square] - PIECE_VALUES[PAWN];
+    }
+    attackers = attackers_of(*board, sq, occupied);
+    for(;;) {
+        occupied ^= from;
+        attackers |= (bishop_attacks_sq(sq, occupied) & diagonal)
+            | (rook_attacks_sq(sq, occupied) & straight);
+        attackers &= occupied;
+        black = !black;
+        side = attackers & (black ? ~board->whites : board->whites);
+        if(!side || depth == 31)
+            break;
+        for(type = PAWN; !(side & pieces[type]); type++);
+        from = side & pieces[type];
+        from &= -from;
+        // what the capturer stands to win if it's then taken in turn
+        depth++;
+        gain[depth] = PIECE_VALUES[on_square] - gain[depth - 1];
+        on_square = type;
+    }
+    // each side can stop capturing when that leaves it better off
+    for(; depth > 0; depth--) {
+        if(-gain[depth] < gain[depth - 1])
+            gain[depth - 1] = -gain[depth];
+    }
+    return gain[0];
+}
+
+
+bool gives_check(const Bitboard *board, Move move)
+{
+    /* whether a move checks the enemy king, without making it: either
+     * the piece attacks the king from where it lands, or it uncovers one
+     * of its side's sliders. Castling and en-passant move or take a
+     * second piece, so those are tried on a copy */
+    bool black = board->black_move;
+    uint64_t king = board->kings & side_pieces(*board, !black);
+    uint64_t occupied = (occupied_squares(*board) & ~move.src) | move.dst;
+    uint64_t own = side_pieces(*board, black) & ~move.src;
+    uint64_t attacks;
+    Bitboard tmp_board;
+    int type = board->piece[bitscan(move.src)] & 7;
+    int dst = bitscan(move.dst);
+    int king_sq;
+    if(!king)
+        return false;
+    if(move.special & (CASTLE_KS | CASTLE_QS | ENPASSANT)) {
+        tmp_board = *board;
+        apply_move(&tmp_board, move);
+        return in_check(tmp_board, !black);
+    }
+    if(move.special & PROMOTE)
+        type = promotion_piece(move);
+    switch(type) {
+        case PAWN:
+            attacks = pawn_attacks_sq(dst, black);
+            break;
+        case KNIGHT:
+            attacks = knight_attacks_sq(dst);
+            break;
+        case BISHOP:
+            attacks = bishop_attacks_sq(dst, occupied);
+            break;
+        case ROOK:
+            attacks = rook_attacks_sq(dst, occupied);
+            break;
+        case QUEEN:
+            attacks = queen_attacks_sq(dst, occupied);
+            break;
+        default:
+            attacks = EMPTY_BOARD;
+    }
+    if(attacks & king)
+        return true;
+    king_sq = bitscan(king);
+    return (bishop_attacks_sq(king_sq, occupied) & own & (board->bishops | board->queens))
+        || (rook_attacks_sq(king_sq, occupied) & own & (board->rooks | board->queens));
+}
+
+
+bool is_capture(const Bitboard *board, Move move)
+{
+    return board->piece[bitscan(move.dst)] || move.special == ENPASSANT;
+}
+
+
+void score_moves(const Bitboard *board, const MoveList *move_list, int *scores, PackedMove hash_move, int ply)
+{
+    /*
+     * Give each move a sort key for pick_move: the hash move first, then
+     * captures and promotions by most valuable victim less the attacker,
+     * then the killers and the rest by their history score. The piece
+     * constants already run in order of value, pawn up to queen.
+     * Captures which lose material in the exchange go last of all, by
+     * how much they lose. Only a capture by a more valuable piece can,
+     * so only those need the exchange working out
+     */
+    PackedMove packed;
+    Move move;
+    int victim;
+    int attacker;
+    int exchange;
+    if(ply >= MAX_PLY)
+        ply = MAX_PLY - 1;
+    for(int i = 0; i < move_list->count; i++) {
+        move = move_list->moves[i];
+        packed = pack_move(move);
+        victim = board->piece[bitscan(move.dst)] & 7;
+        if(move.special == ENPASSANT)
+            victim = PAWN;
+        if(move.special == PROMOTE_QUEEN)
+            victim += QUEEN;
+        if(packed == hash_move) {
+            scores[i] = ORDER_HASH_MOVE;
+        } else if(victim) {
+            attacker = board->piece[bitscan(move.src)] & 7;
+            exchange = 0;
+            if(PIECE_VALUES[attacker] > PIECE_VALUES[board->piece[bitscan(move.dst)] & 7])
+                exchange = see(board, move);
+            scores[i] = exchange < 0 ? exchange : ORDER_CAPTURE + victim * 8 - attacker;
+        } else if(packed == SEARCH_STACK[ply].killers[0]) {
+            scores[i] = ORDER_KILLER;
+        } else if(packed == SEARCH_STACK[ply].killers[1]) {
+            scores[i] = ORDER_KILLER - 1;
+        } else {
+            scores[i] = HISTORY[board->black_move][packed & 63][(packed >> 6) & 63];
+        }
+    }
+}
+
+
+Move pick_move(MoveList *move_list, int *scores, int index)
+{
+    /* selection sort one move at a time, swapping the best of those left
+     * into place, as a cutoff often means the rest are never looked at */
+    int best = index;
+    int swap_score;
+    Move swap;
+    for(int i = index + 1; i < move_list->count; i++) {
+        if(scores[i] > scores[best])
+            best = i;
+    }
+    swap = move_list->moves[index];
+    move_list->moves[index] = move_list->moves[best];
+    move_list->moves[best] = swap;
+    swap_score = scores[index];
+    scores[index] = scores[best];
+    scores[best] = swap_score;
+    return move_list->moves[index];
+}
+
+
+void update_quiet_cutoff(const Bitboard *board, Move move, int depth, int ply)
+{
+    // remember a quiet move which refuted a position
+    PackedMove packed = pack_move(move);
+    int *history = &HISTORY[board->black_move][packed & 63][(packed >> 6) & 63];
+    PackedMove *killers;
+    if(ply >= MAX_PLY)
+        ply = MAX_PLY - 1;
+    killers = SEARCH_STACK[ply].killers;
+    if(killers[0] != packed) {
+        killers[1] = killers[0];
+        killers[0] = packed;
+    }
+    // keep history below the killers, halving everything when it fills up
+    *history += depth * depth;
+    if(*history >= ORDER_KILLER - 1) {
+        for(int side = 0; side < 2; side++) {
+            for(int from = 0; from < 64; from++) {
+                for(int to = 0; to < 64; to++)
+                    HISTORY[side][from][to] /= 2;
+            }
+        }
+    }
+}
+
+
+int quiescence(Bitboard *board, int ply, int alpha, int beta)
+{
+    /*
+     * Search captures and promotions until the position is quiet, so the
+     * evaluation isn't taken in the middle of an exchange. The side to
+     * move can "stand pat" on the evaluation rather than capture, unless
+     * it's in check where every evasion is searched, and without one is
+     * mated. Captures which see says lose material are left out
+     */
+    SearchPly *node = &SEARCH_STACK[ply];
+    MoveList *move_list = &node->move_list;
+    int *scores = node->scores;
+    Undo undo;
+    Move move;
+    int best = -INFINITE_SCORE;
+    int score;
+    int who_moved = board->black_move ? -1 : 1;
+    bool check = in_check(*board, board->black_move);
     int i;
-    for(i = 0; i < pos; i++) {
-        move_list = move_list->next;
+    node->pv_length = ply;
+    if(search_should_stop())
+        return 0;
+    search_stats.nodes++;
+    search_stats.qnodes++;
+    if(!check || ply >= MAX_PLY) {
+        best = eval_shannon(*board) * who_moved;
+        if(best >= beta || ply >= MAX_PLY)
+            return best;
+        if(best > alpha)
+            alpha = best;
+    }
+    legal_captures_for_board(move_list, *board);
+    if(check && !move_list->count)
+        return -MATE_SCORE + ply;
+    score_moves(board, move_list, scores, NO_MOVE, ply);
+    for(i = 0; i < move_list->count; i++) {
+        move = pick_move(move_list, scores, i);
+        // the rest are captures losing material, not worth standing pat for
+        if(!check && scores[i] < 0) {
+            search_stats.see_prunes += move_list->count - i;
+            break;
+        }
+        make_move(board, move, &undo);
+        score = -quiescence(board, ply + 1, -beta, -alpha);
+        unmake_move(board, move, &undo);
+        if(search_aborted)
+            return 0;
+        if(score > best) {
+            best = score;
+            if(best > alpha)
+                alpha = best;
+            if(alpha >= beta)
+                break;
+        }
+    }
+    return best;
+}
+
+
+void update_pv(int ply, PackedMove move)
+{
+    // move is the best at ply so far, followed by the best line after it
+    SearchPly *node = &SEARCH_STACK[ply];
+    SearchPly *child = &SEARCH_STACK[ply + 1];
+    node->pv[ply] = move;
+    memcpy(&node->pv[ply + 1], &child->pv[ply + 1], (child->pv_length - ply - 1) * sizeof(PackedMove));
+    node->pv_length = child->pv_length;
+}
+
+
+int score_to_tt(int score, int ply)
+{
+    /* mate scores count plies from the root, but a table entry can be
+     * found again at any ply, so store them counted from the position */
+    if(score > MATE_BOUND)
+        return score + ply;
+    if(score < -MATE_BOUND)
+        return score - ply;
+    return score;
+}
+
+
+int score_from_tt(int score, int ply)
+{
+    if(score > MATE_BOUND)
+        return score - ply;
+    if(score < -MATE_BOUND)
+        return score + ply;
+    return score;
+}
+
+
+int alphabeta(Bitboard *board, int depth, int ply, int alpha, int beta)
+{
+    /* negamax which stops searching a position once a reply refutes it,
+     * the score is exact whenever it falls inside (alpha, beta) so the
+     * root, searched with the full window, scores the same as negamax.
+     * Positions seen before come from the transposition table, or at
+     * least their best move is tried first.
+     * Once the first move has set alpha the rest are expected to score
+     * below it (principal variation search), so each is only asked
+     * whether it beats alpha with a null window and searched again with
+     * the full window if it does.
+     * Away from the principal variation search_options lets the search
+     * be selective: a position still above beta after passing the move
+     * is cut (null move pruning), quiet moves late in the ordering are
+     * searched shallower unless they beat alpha, and near the leaves a
+     * position too far below alpha skips its quiet moves */
+    if(depth==0)
+        return quiescence(board, ply, alpha, beta);
+    SearchPly *node = &SEARCH_STACK[ply];
+    MoveList *move_list = &node->move_list;
+    int *scores = node->scores;
+    node->pv_length = ply;
+    if(search_should_stop())
+        return 0;
+    search_stats.nodes++;
+    Undo undo;
+    TTEntry entry;
+    PackedMove hash_move = NO_MOVE;
+    Move move;
+    Move best_move = {};
+    int alpha_original = alpha;
+    int best = -INFINITE_SCORE;
+    int score = 0;
+    int static_eval = 0;
+    bool pv_node = beta - alpha > 1;
+    bool check = in_check(*board, board->black_move);
+    bool futile = false;
+    bool quiet;
+    int reduction;
+    int i;
+    if(tt_probe(board->hash, &entry)) {
+        hash_move = entry.best_move;
+        entry.score = score_from_tt(entry.score, ply);
+        // a cutoff on the principal variation would cut the line short
+        if(entry.depth >= depth && !pv_node) {
+            if(entry.bound == BOUND_EXACT
+                || (entry.bound == BOUND_LOWER && entry.score >= beta)
+                || (entry.bound == BOUND_UPPER && entry.score <= alpha)) {
+                search_stats.tt_cutoffs++;
+                return entry.score;
+            }
+        }
+    }
+    if(!pv_node && !check && (search_options.null_move || search_options.futility))
+        static_eval = eval_shannon(*board) * (board->black_move ? -1 : 1);
+    if(search_options.futility && !pv_node && !check && depth <= FUTILITY_DEPTH) {
+        if(static_eval + RAZOR_MARGIN * depth <= alpha) {
+            // hopeless unless something can be won right away
+            score = quiescence(board, ply, alpha, alpha + 1);
+            if(score <= alpha) {
+                search_stats.futility_prunes++;
+                return score;
+            }
+        }
+        futile = static_eval + FUTILITY_MARGIN * depth <= alpha;
+    }
+    if(search_options.null_move && !pv_node && !check && !node->null_move
+        && depth >= NULL_MOVE_DEPTH && static_eval >= beta
+        && (side_pieces(*board, board->black_move) & ~(board->pawns | board->kings))) {
+        /* passing is nearly always worse than the best move, so if it
+         * still fails high so would a full search. Not with only pawns
+         * left where having to move can be what loses (zugzwang) */
+        make_null_move(board, &undo);
+        SEARCH_STACK[ply + 1].null_move = true;
+        score = -alphabeta(board, depth - 1 - NULL_MOVE_REDUCTION - depth / 4,
+            ply + 1, -beta, -beta + 1);
+        SEARCH_STACK[ply + 1].null_move = false;
+        unmake_null_move(board, &undo);
+        if(search_aborted)
+            return 0;
+        if(score >= beta) {
+            search_stats.null_move_cutoffs++;
+            // not the score itself, which could be a mate that isn't proven
+            return beta;
+        }
+    }
+    legal_moves_for_board(move_list, *board);
+    if(!move_list->count)
+        return check ? -MATE_SCORE + ply : 0;
+    score_moves(board, move_list, scores, hash_move, ply);
+    for(i = 0; i < move_list->count; i++) {
+        move = pick_move(move_list, scores, i);
+        quiet = !is_capture(board, move) && !(move.special & PROMOTE);
+        if(futile && i > 0 && quiet && !gives_check(board, move)) {
+            search_stats.futility_prunes++;
+            if(static_eval + FUTILITY_MARGIN * depth > best)
+                best = static_eval + FUTILITY_MARGIN * depth;
+            continue;
+        }
+        make_move(board, move, &undo);
+        if(i == 0) {
+            score = -alphabeta(board, depth - 1, ply + 1, -beta, -alpha);
+        } else {
+            reduction = 0;
+            if(search_options.late_move_reductions && i >= LMR_MOVES
+                && depth >= LMR_DEPTH && !check && quiet
+                && scores[i] < ORDER_KILLER - 1
+                && !in_check(*board, board->black_move)) {
+                reduction = i >= LMR_DEEP_MOVES && depth >= LMR_DEEP_DEPTH ? 2 : 1;
+                search_stats.reductions++;
+            }
+            score = -alphabeta(board, depth - 1 - reduction, ply + 1, -alpha - 1, -alpha);
+            if(reduction && score > alpha)
+                score = -alphabeta(board, depth - 1, ply + 1, -alpha - 1, -alpha);
+            if(score > alpha && score < beta)
+                score = -alphabeta(board, depth - 1, ply + 1, -beta, -alpha);
+        }
+        unmake_move(board, move, &undo);
+        // the scores are meaningless once aborted, so don't store them
+        if(search_aborted)
+            return 0;
+        if(score > best) {
+            best = score;
+            best_move = move;
+            if(best > alpha) {
+                alpha = best;
+                update_pv(ply, pack_move(move));
+            }
+            if(alpha >= beta) {
+                search_stats.cutoffs++;
+                if(i == 0)
+                    search_stats.first_move_cutoffs++;
+                if(quiet)
+                    update_quiet_cutoff(board, move, depth, ply);
+                break;
+            }
+        }
+    }
+    if(best >= beta) {
+        tt_store(board->hash, depth, BOUND_LOWER, score_to_tt(best, ply), best_move);
+    } else if(best <= alpha_original) {
+        // every move failed low so none of them is known to be best
+        tt_store(board->hash, depth, BOUND_UPPER, score_to_tt(best, ply), (Move){});
+    } else {
+        tt_store(board->hash, depth, BOUND_EXACT, score_to_tt(best, ply), best_move);
+    }
+    return best;
+}
+
+
+long elapsed_ms(struct timespec start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+
+bool search_should_stop(void)
+{
+    /* poll the clock every 1024 nodes, reading it costs more than a node.
+     * Once the hard limit passes every node returns straight away */
+    if(search_aborted)
+        return true;
+    if(search_hard_ms && (search_stats.nodes & 1023) == 0
+        && elapsed_ms(search_start) >= search_hard_ms)
+        search_aborted = true;
+    return search_aborted;
+}
+
+
+void search_reset(void)
+{
+    /* forget the last search's statistics and move ordering, and age the
+     * table's entries */
+    memset(&search_stats, 0, sizeof(search_stats));
+    TT_GENERATION++;
+    memset(HISTORY, 0, sizeof(HISTORY));
+    for(int ply = 0; ply <= MAX_PLY; ply++) {
+        SEARCH_STACK[ply].killers[0] = NO_MOVE;
+        SEARCH_STACK[ply].killers[1] = NO_MOVE;
+        SEARCH_STACK[ply].null_move = false;
+    }
+    search_aborted = false;
+}
+
+
+SearchResult search_iteration(Bitboard board, int depth, PackedMove first_move, int alpha, int beta)
+{
+    /* alpha-beta from the root, keeping hold of the move which scored
+     * best and the line after it. first_move, the last iteration's best,
+     * is searched first. A score at or outside the (alpha, beta) window
+     * is only a bound, the full window +-INFINITE_SCORE gives the exact
+     * score */
+    SearchResult result = {-INFINITE_SCORE, {}, depth, 0, {}};
+    MoveList *move_list = &SEARCH_STACK[0].move_list;
+    Undo undo;
+    TTEntry entry;
+    int alpha_original = alpha;
+    int score;
+    int i;
+    legal_moves_for_board(move_list, board);
+    if(first_move == NO_MOVE && tt_probe(board.hash, &entry))
+        first_move = entry.best_move;
+    move_to_front(move_list, first_move);
+    for(i = 0; i < move_list->count; i++) {
+        make_move(&board, move_list->moves[i], &undo);
+        if(i == 0) {
+            score = -alphabeta(&board, depth - 1, 1, -beta, -alpha);
+        } else {
+            score = -alphabeta(&board, depth - 1, 1, -alpha - 1, -alpha);
+            if(score > alpha && score < beta)
+                score = -alphabeta(&board, depth - 1, 1, -beta, -alpha);
+        }
+        unmake_move(&board, move_list->moves[i], &undo);
+        if(search_aborted)
+            return result;
+        if(score > result.score || i == 0) {
+            result.score = score;
+            result.best_move = move_list->moves[i];
+            update_pv(0, pack_move(move_list->moves[i]));
+            result.pv_length = SEARCH_STACK[0].pv_length;
+            memcpy(result.pv, SEARCH_STACK[0].pv, result.pv_length * sizeof(PackedMove));
+            if(score > alpha)
+                alpha = score;
+            if(alpha >= beta)
+                break;
+        }
+    }
+    if(!move_list->count)
+        return result;
+    if(result.score >= beta) {
+        tt_store(board.hash, depth, BOUND_LOWER, result.score, result.best_move);
+    } else if(result.score <= alpha_original) {
+        tt_store(board.hash, depth, BOUND_UPPER, result.score, (Move){});
+    } else {
+        tt_store(board.hash, depth, BOUND_EXACT, result.score, result.best_move);
     }
-    result.src = move_list->src;
-    result.dst = move_list->dst;
-    move_list_delete(&move_list);
     return result;
 }
 
 
-Move negamax_mover(Bitboard board)
+SearchResult search_aspiration(Bitboard board, int depth, PackedMove first_move, int previous)
 {
-    Bitboard tmp_board = {};
-    float score = 0.0;
-    float max = -FLT_MAX;
-    Move result = {};
-    Move *move_list = legal_moves_for_board(board);
-    while(move_list != NULL) {
-        tmp_board = board;
-        apply_move(&tmp_board, *move_list);
-        score = 0 - negamax(tmp_board, 1);
-        if(score > max) {
-            max = score;
-            result.src = move_list->src;
-            result.dst = move_list->dst;
+    /*
+     * The score rarely moves far between iterations, so search a narrow
+     * window around the last one, which prunes far more than the full
+     * window. When the score lands outside it that side of the window is
+     * doubled and the iteration searched again, until it's exact
+     */
+    SearchResult result;
+    int delta = ASPIRATION_WINDOW;
+    int alpha = -INFINITE_SCORE;
+    int beta = INFINITE_SCORE;
+    // a mate score has nothing to put a window around
+    if(depth >= ASPIRATION_DEPTH && abs(previous) < MATE_BOUND) {
+        alpha = previous - delta;
+        beta = previous + delta;
+    }
+    for(;;) {
+        result = search_iteration(board, depth, first_move, alpha, beta);
+        if(search_aborted)
+            return result;
+        if(result.score <= alpha && alpha > -INFINITE_SCORE) {
+            delta *= 2;
+            alpha = delta < 16 * ASPIRATION_WINDOW ? previous - delta : -INFINITE_SCORE;
+            search_stats.aspiration_researches++;
+        } else if(result.score >= beta && beta < INFINITE_SCORE) {
+            delta *= 2;
+            beta = delta < 16 * ASPIRATION_WINDOW ? previous + delta : INFINITE_SCORE;
+            first_move = pack_move(result.best_move);
+            search_stats.aspiration_researches++;
+        } else {
+            return result;
         }
-        move_list = move_list->next;
     }
-    move_list_delete(&move_list);
+}
+
+
+SearchResult search_root(Bitboard board, int depth)
+{
+    // a single search to a fixed depth, however long it takes
+    if(depth > MAX_PLY)
+        depth = MAX_PLY;
+    search_reset();
+    search_hard_ms = 0;
+    return search_iteration(board, depth, NO_MOVE, -INFINITE_SCORE, INFINITE_SCORE);
+}
+
+
+void *search_helper(void *arg)
+{
+    /* a Lazy SMP helper: deepen from the root until told to stop, like
+     * the main thread but a ply or two ahead. Helpers start once the main
+     * thread has finished depth 1 and moved on to depth 2, so they begin
+     * at 3 or 4. Their results reach the main thread only through the
+     * transposition table */
+    SearchHelper *helper = arg;
+    SearchResult iteration;
+    PackedMove first_move = helper->first_move;
+    int depth;
+    for(depth = 3 + helper->id % 2; depth <= helper->max_depth; depth++) {
+        iteration = search_iteration(helper->board, depth, first_move, -INFINITE_SCORE, INFINITE_SCORE);
+        if(search_aborted || !iteration.best_move.dst)
+            break;
+        first_move = pack_move(iteration.best_move);
+    }
+    helper->stats = search_stats;
+    return NULL;
+}
+
+
+void search_stats_add(SearchStats *total, const SearchStats *stats)
+{
+    total->nodes += stats->nodes;
+    total->qnodes += stats->qnodes;
+    total->tt_probes += stats->tt_probes;
+    total->tt_hits += stats->tt_hits;
+    total->tt_cutoffs += stats->tt_cutoffs;
+    total->cutoffs += stats->cutoffs;
+    total->first_move_cutoffs += stats->first_move_cutoffs;
+    total->aspiration_researches += stats->aspiration_researches;
+    total->null_move_cutoffs += stats->null_move_cutoffs;
+    total->reductions += stats->reductions;
+    total->futility_prunes += stats->futility_prunes;
+    total->see_prunes += stats->see_prunes;
+}
+
+
+SearchResult search_iterative(Bitboard board, SearchLimits limits)
+{
+    /*
+     * Search one ply deeper each iteration, starting each with the best
+     * move from the last. No new iteration starts once the soft limit has
+     * passed, as it would likely take longer than all those before it.
+     * At the hard limit the running iteration is abandoned and the last
+     * completed one is returned. Depth 1 always completes so there is a
+     * move to return. Deeper iterations start with an aspiration window
+     * around the previous score.
+     * With search_threads above 1 helper threads join in after depth 1,
+     * filling the shared table with results the main thread can use
+     */
+    static SearchHelper helpers[MAX_SEARCH_THREADS];
+    SearchResult result = {-INFINITE_SCORE, {}, 0, 0, {}};
+    SearchResult iteration;
+    PackedMove first_move = NO_MOVE;
+    int helper_count = 0;
+    int i;
+    // the search stack only has room for MAX_PLY plies
+    if(limits.max_depth > MAX_PLY)
+        limits.max_depth = MAX_PLY;
+    search_reset();
+    clock_gettime(CLOCK_MONOTONIC, &search_start);
+    search_hard_ms = 0;
+    for(int depth = 1; depth <= limits.max_depth; depth++) {
+        iteration = search_aspiration(board, depth, first_move, result.score);
+        if(search_aborted)
+            break;
+        result = iteration;
+        if(!result.best_move.dst)
+            break;
+        first_move = pack_move(result.best_move);
+        if(elapsed_ms(search_start) >= limits.soft_ms)
+            break;
+        if(depth > 1)
+            continue;
+        /* the helpers read the hard limit, so it's set once before they
+         * start and left alone until they've been joined */
+        search_hard_ms = limits.hard_ms;
+        for(; helper_count < search_threads - 1 && helper_count < MAX_SEARCH_THREADS; helper_count++) {
+            helpers[helper_count].board = board;
+            helpers[helper_count].id = helper_count;
+            helpers[helper_count].max_depth = limits.max_depth;
+            helpers[helper_count].first_move = first_move;
+            pthread_create(&helpers[helper_count].thread, NULL, search_helper, &helpers[helper_count]);
+        }
+    }
+    search_aborted = true;
+    for(i = 0; i < helper_count; i++) {
+        pthread_join(helpers[i].thread, NULL);
+        search_stats_add(&search_stats, &helpers[i].stats);
+    }
+    // leave the search able to run again without a search_reset
+    search_aborted = false;
+    search_hard_ms = 0;
     return result;
 }
 
 
-void match_player(MoveChoser player1, MoveChoser player2)
+SearchLimits allocate_time(long remaining_ms, long increment_ms, int moves_to_go)
+{
+    /*
+     * Share the time left on the clock between the moves still to play,
+     * plus most of the increment. The hard limit lets an iteration overrun
+     * to several times that, but never past a fifth of what's left,
+     * and there's always a margin held back for the move to get made
+     */
+    SearchLimits limits = {MAX_SEARCH_DEPTH, 0, 0};
+    long available = remaining_ms - TIME_MARGIN_MS;
+    if(moves_to_go <= 0)
+        moves_to_go = DEFAULT_MOVES_TO_GO;
+    if(available < 1)
+        available = 1;
+    limits.soft_ms = available / moves_to_go + increment_ms * 3 / 4;
+    limits.hard_ms = limits.soft_ms * 4;
+    if(limits.hard_ms > available / 5)
+        limits.hard_ms = available / 5;
+    if(limits.hard_ms < 1)
+        limits.hard_ms = 1;
+    if(limits.soft_ms > limits.hard_ms)
+        limits.soft_ms = limits.hard_ms;
+    return limits;
+}
+
+
+float first_move_cutoff_rate(void)
+{
+    /* percentage of cutoffs made by the first move searched, the better
+     * the move ordering the closer this gets to 100 */
+    if(!search_stats.cutoffs)
+        return 0.0;
+    return 100.0 * search_stats.first_move_cutoffs / search_stats.cutoffs;
+}
+
+
+float tt_hit_rate(void)
 {
+    // percentage of probes in the last search which found their position
+    if(!search_stats.tt_probes)
+        return 0.0;
+    return 100.0 * search_stats.tt_hits / search_stats.tt_probes;
+}
+
+
+Move random_mover(Bitboard board)
+{
+    // return a random move from those available
+    MoveList move_list;
+    legal_moves_for_board(&move_list, board);
+    srand(time(NULL));
+    return move_list.moves[rand() % move_list.count];
+}
+
+
+void print_pv(Bitboard board, const SearchResult *result)
+{
+    // the principal variation in algebra, playing it out on a copy
+    char *algebra;
+    Move move;
+    for(int i = 0; i < result->pv_length; i++) {
+        move = unpack_move(result->pv[i]);
+        algebra = algebra_for_move(board, move);
+        printf("%s%s", i ? " " : "", algebra);
+        free(algebra);
+        apply_move(&board, move);
+    }
+}
+
+
+Move negamax_mover(Bitboard board)
+{
+    SearchResult result = search_iterative(board, mover_limits);
+    printf(
+        "(depth %d, score %d, %lu nodes, transposition table hit rate %.1f%%, "
+        "first move cutoffs %.1f%%, pv ",
+        result.depth, result.score, search_stats.nodes, tt_hit_rate(),
+        first_move_cutoff_rate()
+    );
+    print_pv(board, &result);
+    printf(")\n");
+    return result.best_move;
+}
+
+
+void match_player(MoveChoser player1, MoveChoser player2, long time_ms, long increment_ms)
+{
+    /* play a game between two movers, each with time_ms on their clock
+     * plus increment_ms a move. The engine's limits come from its clock */
     Bitboard board = fen_to_board(START_POS_FEN);
-    int halfmove = 0;
+    long clock_ms[2] = {time_ms, time_ms};
+    struct timespec move_start;
+    int side;
     char *algebra;
     Move next_move;
     printf("\n\n\nGame begins!\n\n");
     print_board(board);
     while(board.halfmove_clock <= 50) {
+        side = board.black_move;
+        mover_limits = allocate_time(clock_ms[side], increment_ms, 0);
+        clock_gettime(CLOCK_MONOTONIC, &move_start);
         if(board.black_move) {
             printf("> black move: ");
             next_move = player2(board);
@@ -1119,12 +3168,18 @@ void match_player(MoveChoser player1, MoveChoser player2)
             printf("> white move: ");
             next_move = player1(board);
         }
+        clock_ms[side] -= elapsed_ms(move_start);
+        if(clock_ms[side] < 0) {
+            printf("\n\n%s loses on time\n", side ? "black" : "white");
+            exit(0);
+        }
+        clock_ms[side] += increment_ms;
         algebra = algebra_for_move(board, next_move);
         apply_move(&board, next_move);
         printf("\n%s\n", algebra);
         print_board(board);
-        if(in_check(board)){
-            if(!can_escape_check(board)) {
+        if(in_check(board, board.black_move)){
+            if(!has_legal_move(board)) {
                 printf("\n\nCHECK MATE after %d moves\n", board.fullmove_clock);
                 exit(0);
             }
@@ -20,6 +20,8 @@
 #define PROMOTE 120
 
 #define START_POS_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
+// a middlegame with castling, pins, en-passant and promotions to find
+#define KIWIPETE_FEN "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1"
 
 typedef enum {
     a1, b1, c1, d1, e1, f1, g1, h1,
@@ -53,28 +55,248 @@ typedef struct {
     int fullmove_clock;
     // en passant target
     uint64_t enpassant;
+    // piece nibble on each square indexed a1..h8, 0 when empty, kept in
+    // step with the bitboards by add_piece_to_board and remove_piece
+    uint8_t piece[64];
+    // Zobrist key of the position, see zobrist_key
+    uint64_t hash;
+    /* the static part of the evaluation for each side, white 0 and
+     * black 1, summed by add_piece_to_board and remove_piece: material
+     * in centipawns, piece-square table scores for the middle and end
+     * game, and how far from the end game the pieces left make it */
+    int32_t material[2];
+    int16_t pst[2][2];
+    int8_t phase;
 } Bitboard;
 
-typedef struct move_item {
+// indexes into Bitboard pst, and phase at the start of a game
+#define PHASE_MG 0
+#define PHASE_EG 1
+#define MAX_PHASE 24
+
+typedef struct {
     uint64_t src;
     uint64_t dst;
     uint8_t special;
-    struct move_item *next;
 } Move;
 
+/* a move in 16 bits for tables and lines which keep a lot of them, the
+ * from square in bits 0-5, to square in 6-11 and a flag nibble standing
+ * for the special in 12-15. 0 (a1a1) is never a real move */
+typedef uint16_t PackedMove;
+#define NO_MOVE 0
+
+// what make_move records so unmake_move can restore the board
+typedef struct {
+    uint64_t hash;
+    uint64_t enpassant;
+    int halfmove_clock;
+    uint8_t captured;   // piece nibble taken on the destination square
+    uint8_t castling;   // castle flags, wks, wqs, bks, bqs from bit 0
+} Undo;
+
+// no legal chess position has more than 218 moves
+#define MAX_MOVES 256
+
+typedef struct {
+    int count;
+    Move moves[MAX_MOVES];
+} MoveList;
+
+
+// checks and pins against the side to move, found once per position
+typedef struct {
+    int king_sq;
+    uint64_t checkers;  // enemy pieces giving check
+    uint64_t pinned;    // our pieces which can only move along the pin
+    uint64_t danger;    // squares attacked by the enemy, our king can't go
+} CheckInfo;
+
+// lookup for a slider's attacks from one square
+typedef struct {
+    uint64_t mask;      // squares whose occupancy can block the slider
+    uint64_t magic;     // multiplier hashing blockers to a table index
+    uint64_t *attacks;  // this square's slice of the attack table
+    int shift;
+} SliderMagic;
+
+// table entries summed over all squares, 2^(bits in each square's mask)
+#define ROOK_ATTACK_ENTRIES 102400
+#define BISHOP_ATTACK_ENTRIES 5248
+
 
 // typedef for where we need a function pointer
 typedef uint64_t (*PieceMover)(uint64_t pieces, uint64_t enemies, uint64_t allies);
 typedef Move (*MoveChoser)(Bitboard board);
 
+// deepest ply the search keeps killer moves and principal variations for
+#define MAX_PLY 64
+
+// evaluation weights in centipawns
+#define PAWN_VALUE 100
+#define KNIGHT_VALUE 300
+#define BISHOP_VALUE 300
+#define ROOK_VALUE 500
+#define QUEEN_VALUE 800
+#define KING_VALUE 20000
+#define MOBILITY_VALUE 10       // per move, or safe square attacked
+#define BLOCKED_PAWN_VALUE 50
+#define DOUBLED_PAWN_VALUE 50
+
+/* scores are in centipawns from the side to move's point of view. Being
+ * mated scores -MATE_SCORE plus the plies to the mate, so quicker mates
+ * are preferred, and anything beyond MATE_BOUND is a mate. Every score
+ * lies strictly inside +-INFINITE_SCORE and fits 16 bits */
+#define MATE_SCORE 30000
+#define MATE_BOUND (MATE_SCORE - MAX_PLY - 1)
+#define INFINITE_SCORE 32000
+
+// what a search reports back from the root
+typedef struct {
+    int score;
+    Move best_move;
+    int depth;      // of the last completed iteration
+    int pv_length;
+    PackedMove pv[MAX_PLY];    // the line expected from best_move on
+} SearchResult;
+
+// how far and for how long in milliseconds to search
+typedef struct {
+    int max_depth;
+    long soft_ms;   // no new iteration is started after this
+    long hard_ms;   // the running iteration is abandoned at this
+} SearchLimits;
+
+#define MAX_SEARCH_DEPTH 32
+#define DEFAULT_SOFT_MS 1000
+#define DEFAULT_HARD_MS 5000
+// allocate_time's guess at the moves left when the clock doesn't say
+#define DEFAULT_MOVES_TO_GO 30
+// kept back on the clock for everything other than searching
+#define TIME_MARGIN_MS 50
+
+// how a stored score relates to the position's true score
+#define BOUND_UPPER 1
+#define BOUND_LOWER 2
+#define BOUND_EXACT 3
+
+/* window the search tries around the last iteration's score before
+ * falling back to a wider one. Iterations shallower than
+ * ASPIRATION_DEPTH are too erratic for it to be worthwhile */
+#define ASPIRATION_WINDOW 25
+#define ASPIRATION_DEPTH 4
+
+/* what the transposition table knows of a position, bound 0 is unknown.
+ * generation is the search which stored it */
+typedef struct {
+    int16_t score;
+    PackedMove best_move;
+    int8_t depth;
+    uint8_t bound;
+    uint16_t generation;
+} TTEntry;
+
+/* a TTEntry packed into data as stored in the table. check is the
+ * Zobrist hash xor'd with data, so an entry torn by two threads writing
+ * at once fails the lookup rather than returning a mix of both */
+typedef struct {
+    uint64_t check;
+    uint64_t data;
+} TTSlot;
+
+// a 64 byte cache line of slots sharing the low bits of their hash
+#define TT_BUCKET_ENTRIES 4
+typedef struct {
+    TTSlot slots[TT_BUCKET_ENTRIES];
+} TTBucket;
+
+#define TT_DEFAULT_MB 16
+
+// move ordering sort keys, history scores stay below the killers
+#define ORDER_HASH_MOVE (1 << 30)
+#define ORDER_CAPTURE (1 << 20)
+#define ORDER_KILLER (1 << 19)
+
+/* what the search keeps for each ply, preallocated per thread so a
+ * search makes no allocations and uses a fixed amount of memory */
+typedef struct {
+    MoveList move_list;
+    int scores[MAX_MOVES];      // move_list's sort keys
+    PackedMove killers[2];      // quiet moves which caused a cutoff
+    bool null_move;             // reached by passing the move
+    int pv_length;              // the best line runs from here to pv_length
+    PackedMove pv[MAX_PLY + 1];
+} SearchPly;
+
+// switches for the evaluation
+typedef struct {
+    /* count mobility as legal moves, rather than the safe squares each
+     * piece attacks, which is slower but exact */
+    bool legal_mobility;
+} EvalOptions;
+
+// switches for the selective parts of the search
+typedef struct {
+    bool null_move;             // null move pruning
+    bool late_move_reductions;
+    bool futility;              // futility pruning and razoring near the leaves
+} SearchOptions;
+
+/* null move pruning searches the reply to a pass NULL_MOVE_REDUCTION
+ * plies shallower, plus another ply for every 4 of depth, and only
+ * from NULL_MOVE_DEPTH up */
+#define NULL_MOVE_DEPTH 3
+#define NULL_MOVE_REDUCTION 2
+/* quiet moves after the first LMR_MOVES at LMR_DEPTH or more are
+ * searched a ply shallower, two after LMR_DEEP_MOVES at LMR_DEEP_DEPTH */
+#define LMR_MOVES 3
+#define LMR_DEPTH 3
+#define LMR_DEEP_MOVES 8
+#define LMR_DEEP_DEPTH 6
+/* within FUTILITY_DEPTH of the leaves quiet moves aren't tried when the
+ * evaluation plus FUTILITY_MARGIN a ply can't reach alpha,
+ * and a position RAZOR_MARGIN below is left to the quiescence search */
+#define FUTILITY_DEPTH 2
+#define FUTILITY_MARGIN 150
+#define RAZOR_MARGIN 300
+
+// counters for the most recent search
+typedef struct {
+    uint64_t nodes;
+    uint64_t qnodes;    // of the nodes, those in the quiescence search
+    uint64_t tt_probes;
+    uint64_t tt_hits;
+    uint64_t tt_cutoffs;
+    uint64_t cutoffs;
+    uint64_t first_move_cutoffs;
+    uint64_t aspiration_researches; // iterations searched again with a wider window
+    uint64_t null_move_cutoffs;
+    uint64_t reductions;        // late moves searched shallower
+    uint64_t futility_prunes;   // quiet moves and razored positions skipped
+    uint64_t see_prunes;        // losing captures the quiescence search skipped
+} SearchStats;
+
+// a Lazy SMP helper thread searching alongside the main one
+#define MAX_SEARCH_THREADS 256
+typedef struct {
+    Bitboard board;
+    int id;
+    int max_depth;
+    PackedMove first_move;
+    SearchStats stats;  // the helper's counts once it has finished
+    pthread_t thread;
+} SearchHelper;
+
 
 Bitboard fen_to_board(const char *fen);
 void print_board(Bitboard board);
 char piece_letter(int piece);
 uint64_t upside_down(uint64_t bitlayer);
 Bitboard enemy_board(Bitboard board);
+void init_cpu_features(void);
 int population_count (uint64_t bitlayer);
 uint64_t occupied_squares(Bitboard board);
+uint64_t side_pieces(Bitboard board, bool black);
 uint64_t shift_n( uint64_t bitlayer );
 uint64_t shift_ne( uint64_t bitlayer );
 uint64_t shift_nw( uint64_t bitlayer );
@@ -85,41 +307,120 @@ uint64_t shift_e( uint64_t bitlayer );
 uint64_t shift_w( uint64_t bitlayer );
 uint64_t upside_down( uint64_t bitlayer );
 uint64_t pawn_moves(uint64_t rooks, uint64_t enemies, uint64_t allies);
+uint64_t pawn_pushes(uint64_t pawns, uint64_t occupied, bool black);
+uint64_t pawn_captures(uint64_t pawns, bool black);
 uint64_t rook_attacks(uint64_t rooks, uint64_t enemies, uint64_t allies);
 uint64_t bishop_attacks(uint64_t bishops, uint64_t enemies, uint64_t allies);
 uint64_t queen_attacks(uint64_t queens, uint64_t enemies, uint64_t allies);
+uint64_t rook_attacks_loop(uint64_t rooks, uint64_t enemies, uint64_t allies);
+uint64_t bishop_attacks_loop(uint64_t bishops, uint64_t enemies, uint64_t allies);
+uint64_t rook_attacks_sq(int sq, uint64_t occupied);
+uint64_t bishop_attacks_sq(int sq, uint64_t occupied);
+uint64_t queen_attacks_sq(int sq, uint64_t occupied);
+uint64_t xorshift64(uint64_t *state);
+bool magic_fits(const SliderMagic *m, const uint64_t *occupancy, const uint64_t *reference_attacks, int size);
+uint64_t *init_slider_square(SliderMagic *m, uint64_t mask, uint64_t square, uint64_t (*reference)(uint64_t, uint64_t, uint64_t), uint64_t magic, uint64_t *attacks, uint64_t *seed);
+void init_tables(void);
+void init_line_tables(void);
+void init_zobrist(void);
+int castling_flags(const Bitboard *board);
+uint64_t zobrist_key(Bitboard board);
 uint64_t king_attacks(uint64_t kings, uint64_t enemies, uint64_t allies);
 uint64_t knight_attacks(uint64_t knights, uint64_t enemies, uint64_t allies);
 uint64_t pawn_attacks(uint64_t pawns, uint64_t allies);
 uint64_t sliding_attack( uint64_t (*slider)(uint64_t), uint64_t attackers, uint64_t enemies, uint64_t allies);
+uint64_t knight_attacks_sq(int sq);
+uint64_t king_attacks_sq(int sq);
+uint64_t pawn_attacks_sq(int sq, bool black);
+uint64_t moves_from_square(int piece, int sq, uint64_t enemies, uint64_t allies, bool black);
 PieceMover mover_func(int piece);
 uint64_t delete_ls1b(uint64_t bitlayer, uint64_t *deleted_bit);
 int bitscan( uint64_t b );
+int pop_square(uint64_t *bitlayer);
 int fen_to_piece(int fen_char);
 void add_piece_to_board(Bitboard *board, int piece, uint64_t target);
-bool in_check(Bitboard board);
-uint64_t standard_attacks(Bitboard board);
+bool in_check(Bitboard board, bool black);
+uint64_t attackers_of(Bitboard board, int sq, uint64_t occupied);
+uint64_t standard_attacks(Bitboard board, bool black);
 bool can_escape_check(Bitboard board);
+uint64_t *piece_bitboard(Bitboard *board, int piece);
+void update_eval_totals(Bitboard *board, int piece, int sq, int sign);
+void init_eval_totals(Bitboard *board);
 int piece_at_square(Bitboard b, uint64_t t);
 int remove_piece(Bitboard *b, uint64_t t);
+int promotion_piece(Move move);
 void apply_move(Bitboard *board_ref, const Move move);
-void move_list_push(Move **move_list, Move move);
-int move_list_count(Move *move_list);
-int move_list_delete(Move **move_list);
-void legal_moves(Move **move_list, Bitboard board, uint64_t origin, uint64_t targets);
-void legal_moves_for_piece(Move **move_list, Bitboard board, int piece);
-void legal_moves_for_pawns(Move **move_list, Bitboard board);
-void legal_moves_castling(Move **move_list, Bitboard board);
-void move_list_rotate(Move *moves);
-Move *legal_moves_for_board(Bitboard board);
+void make_move(Bitboard *board, const Move move, Undo *undo);
+void unmake_move(Bitboard *board, const Move move, const Undo *undo);
+void make_null_move(Bitboard *board, Undo *undo);
+void unmake_null_move(Bitboard *board, const Undo *undo);
+void move_list_push(MoveList *move_list, Move move);
+PackedMove pack_move(Move move);
+Move unpack_move(PackedMove packed);
+void legal_moves(MoveList *move_list, Bitboard board, uint64_t origin, uint64_t targets);
+void legal_moves_for_piece(MoveList *move_list, Bitboard board, int piece);
+void legal_moves_for_pawns(MoveList *move_list, Bitboard board);
+void legal_moves_castling(MoveList *move_list, Bitboard board);
+bool castle_path_safe(Bitboard board, uint64_t path);
+bool enpassant_legal(Bitboard board, Move move, bool black);
+void move_list_rotate(MoveList *move_list);
+void legal_moves_for_board(MoveList *move_list, Bitboard board);
+void legal_moves_for_board_reference(MoveList *move_list, Bitboard board);
+uint64_t side_attacks(Bitboard board, bool black, uint64_t occupied);
+CheckInfo check_info(Bitboard board);
+uint64_t legal_targets(const CheckInfo *info, int piece, int sq, uint64_t enemies, uint64_t allies, bool black, uint64_t target_mask);
+uint64_t enpassant_capturers(Bitboard board, uint64_t target_mask);
+void legal_moves_by_mask(MoveList *move_list, Bitboard board, const CheckInfo *info, uint64_t target_mask);
+uint64_t evasion_mask(const CheckInfo *info);
+int castling_available(Bitboard board, const CheckInfo *info);
+int legal_move_count_by_mask(Bitboard board, const CheckInfo *info, uint64_t target_mask, bool any);
+int count_legal_moves(Bitboard board);
+bool has_legal_move(Bitboard board);
+void legal_moves_filtered(MoveList *move_list, Bitboard board, const CheckInfo *info, uint64_t target_mask, bool captures_only);
+void legal_captures_for_board(MoveList *move_list, Bitboard board);
+void legal_moves_evasions(MoveList *move_list, Bitboard board, const CheckInfo *info);
+void legal_moves_castling_safe(MoveList *move_list, Bitboard board, const CheckInfo *info);
 uint64_t squares_with_piece(Bitboard board, int piece);
 uint64_t src_pieces(Bitboard board, uint64_t target, int piece);
 Move parse_algebra(Bitboard board, const char *algebra);
 char *algebra_for_move(Bitboard board, Move move);
-float eval_shannon(Bitboard board);
+int attack_mobility(Bitboard board, bool black);
+int eval_shannon(Bitboard board);
 uint64_t doubled_pawns(uint64_t pawns);
-float negamax(Bitboard board, int depth);
+int negamax(Bitboard *board, int depth, int ply);
+int see(const Bitboard *board, Move move);
+bool gives_check(const Bitboard *board, Move move);
+bool is_capture(const Bitboard *board, Move move);
+void score_moves(const Bitboard *board, const MoveList *move_list, int *scores, PackedMove hash_move, int ply);
+Move pick_move(MoveList *move_list, int *scores, int index);
+void update_quiet_cutoff(const Bitboard *board, Move move, int depth, int ply);
+int quiescence(Bitboard *board, int ply, int alpha, int beta);
+void update_pv(int ply, PackedMove move);
+int score_to_tt(int score, int ply);
+int score_from_tt(int score, int ply);
+int alphabeta(Bitboard *board, int depth, int ply, int alpha, int beta);
+long elapsed_ms(struct timespec start);
+bool search_should_stop(void);
+void search_reset(void);
+SearchResult search_iteration(Bitboard board, int depth, PackedMove first_move, int alpha, int beta);
+SearchResult search_aspiration(Bitboard board, int depth, PackedMove first_move, int previous);
+SearchResult search_root(Bitboard board, int depth);
+void *search_helper(void *arg);
+void search_stats_add(SearchStats *total, const SearchStats *stats);
+SearchResult search_iterative(Bitboard board, SearchLimits limits);
+SearchLimits allocate_time(long remaining_ms, long increment_ms, int moves_to_go);
+void tt_init(size_t megabytes);
+void tt_clear(void);
+uint64_t tt_pack_entry(TTEntry entry);
+TTEntry tt_unpack_entry(uint64_t data);
+bool tt_probe(uint64_t hash, TTEntry *entry);
+int tt_replace_worth(uint64_t data);
+void tt_store(uint64_t hash, int depth, int bound, int score, Move best_move);
+float tt_hit_rate(void);
+float first_move_cutoff_rate(void);
+void move_to_front(MoveList *move_list, PackedMove move);
 Move random_mover(Bitboard board);
+void print_pv(Bitboard board, const SearchResult *result);
 Move negamax_mover(Bitboard board);
 Move human_mover(Bitboard board);
-void match_player(MoveChoser player1, MoveChoser player2);
+void match_player(MoveChoser player1, MoveChoser player2, long time_ms, long increment_ms);